@@ -7,6 +7,7 @@
   Copyright (C) 2012, Adrian Ratnapala, under the ISC license. See file LICENSE.
 */
 
+#define _GNU_SOURCE  // 0unit.h needs POSIX timers and wait4()
 #include <string.h>
 
 #include "0unit.h"
@@ -27,12 +28,22 @@ static int test_something_good()
         CHK(4 == ++x);
         CHK(5 == ++x);
 
+        // NOTE() prints informational output, such as a measurement, without
+        // affecting whether the test passes.
+        NOTE("x ended up as %d", x);
+
+        // BENCH() measures how long its statements take per run.  Values they
+        // compute but don't use go in BENCH_KEEP(), lest the compiler skip
+        // computing them.
+        BENCH("squaring", BENCH_KEEP(x * x));
+
         // end every test with PASS(), this prints a success message to stdout.
         PASS();
 }
 
-// This is another test, but it is designed to fail.
-static int test_something_bad()
+// This is another test, but it is designed to fail.  Defining it with TEST()
+// registers it, so zunit_main() (below) can find and run it.
+TEST(test_something_bad)
 {
         int x = 3;
 
@@ -47,20 +58,27 @@ static int test_something_bad()
         PASS();
 }
 
-// 0unit cannot run tests automatically, you must call them yourself.
+// Tests not defined with TEST() you must call yourself.
 int main(int argc, const char **argv)
 {
-        // this test will fail
-        test_something_bad();
+        // run the registered tests (or those named on the command line, or
+        // just list them all given "--list"; "--fork" runs each in its own
+        // process, several at once; "--times" reports how long each took and
+        // "--baseline=FILE" fails those that got much slower than in FILE).
+        // This one will fail ...
+        zunit_main(argc, argv);
         // but execution will continue so this one can pass.
         test_something_good();
 
-        return 0;
+        return zunit_report();
 }
 
 /*
 The output should be something like
-        FAILED: 0example.c:39:test_something_bad <strlen("wrong answer") < strlen("question")>
+        FAILED: 0example.c:53:test_something_bad <strlen("wrong answer") < strlen("question")>
+        note: test_something_good: x ended up as 5
+        bench: test_something_good: squaring: 0.4 ns/op, min 0.4, median 0.4, p99 0.5, n 105906176
         passed: test_something_good
+        1 of 2 tests FAILED.
 */
 
@@ -2,6 +2,7 @@
   zunit.h: unit testing without a real framework.
 
   These are minute definitoins to help you write unit tests.  See 0example.c.
+  Define _GNU_SOURCE (or _DEFAULT_SOURCE) before including this.
 
   Copyright (C) 2012, Adrian Ratnapala, under the ISC license. See file LICENSE.
 */
@@ -10,8 +11,16 @@
 #ifndef _0UNIT_H
 #define _0UNIT_H
 
+#include <fnmatch.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifndef CHECK_FMT
 # ifdef __GNUC__
@@ -29,6 +38,7 @@
 #define CHK(T) CHKV(T, "%s", #T)
 #define FAIL(...) CHKV(0, __VA_ARGS__)
 #define WRN(...) wrn( 0, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define NOTE(...) note( __func__, __VA_ARGS__)
 
 #define PASS()                   \
         return pass( __func__ ); \
@@ -98,6 +108,17 @@ inline static int wrn(int pass, const char *file, int line, const char *test,
         return fail(ZUNIT_ANSI_COLOUR(31, "WARNING:"), file, line, test, fmt, va);
 }
 
+CHECK_FMT(2)
+inline static void note(const char *test, const char *fmt, ...)
+/* Informational output (e.g. measurements) that neither passes nor fails. */
+{
+        va_list va;
+        va_start(va, fmt);
+        printf("note: %s: ", test);
+        vprintf(fmt, va);
+        printf("\n");
+        va_end(va);
+}
 
 inline static int pass(const char *test) {
         printf(ZUNIT_ANSI_COLOUR(32, "passed:")" %s\n", test);
@@ -105,4 +126,505 @@ inline static int pass(const char *test) {
         return 1;
 }
 
+/*
+  Registered tests.  Defining a test with
+
+        TEST(test_name) { ... PASS(); }
+
+  also registers it, so that zunit_main() can run it.  Tests are registered (by
+  a constructor function) in the order they are defined, and run in that order.
+  A test defined with
+
+        TEST_DIES(test_name, STATUS) { ... }
+
+  should make the process exit with the given status (e.g. by an uncaught
+  panic), so zunit_main() always runs it in a child process.  It passes if the
+  child exits with that status, and then what it wrote to stderr is dropped.
+  ZUNIT_NAMED(test_name) registers the name of a test which main() still runs
+  by hand, e.g. because it takes arguments.
+*/
+
+#ifndef ZUNIT_MAX_TESTS
+#define ZUNIT_MAX_TESTS 1024
+#endif
+
+#define TEST(NAME)                                                       \
+        static int NAME();                                               \
+        ZUNIT_REGISTER(NAME, NAME, -1)                                   \
+        static int NAME()
+
+#define TEST_DIES(NAME, STATUS)                                          \
+        static int NAME();                                               \
+        ZUNIT_REGISTER(NAME, NAME, (STATUS) & 255)                       \
+        static int NAME()
+
+#define ZUNIT_NAMED(NAME) ZUNIT_REGISTER(NAME, 0, -1)
+
+#define ZUNIT_REGISTER(NAME, FN, XSTATUS)                                \
+        __attribute__((constructor)) static void zunit_register_##NAME() \
+        {                                                                \
+                zunit_register(#NAME, (FN), (XSTATUS), __FILE__, __LINE__); \
+        }
+
+static struct {
+        const char *name;
+        int (*fn)();   // NULL for tests run by hand
+        int xstatus;   // the exit status of a TEST_DIES, else -1
+        const char *file;
+        int line;
+        double base_cpu_ms; // from the baseline file, or < 0
+} zunit_tests[ZUNIT_MAX_TESTS];
+static int zunit_ntests = 0;
+
+static const char **zunit_argv = NULL; // zunit_main's, holding the filters
+static int zunit_argc = 0;
+static FILE *zunit_results = NULL;
+
+inline static void zunit_register(const char *name, int (*fn)(), int xstatus,
+                                  const char *file, int line)
+{
+        if(zunit_ntests == ZUNIT_MAX_TESTS) {
+                fprintf(stderr, "0unit: more than %d tests\n", ZUNIT_MAX_TESTS);
+                abort();
+        }
+        zunit_tests[zunit_ntests].name = name;
+        zunit_tests[zunit_ntests].fn = fn;
+        zunit_tests[zunit_ntests].xstatus = xstatus;
+        zunit_tests[zunit_ntests].file = file;
+        zunit_tests[zunit_ntests].line = line;
+        zunit_tests[zunit_ntests++].base_cpu_ms = -1;
+}
+
+inline static int zunit_selected(const char *name)
+/* Whether the filters given to zunit_main() select this test. */
+{
+        int nfilters = 0;
+        for(int k = 1; k < zunit_argc; k++) {
+                if(!strncmp(zunit_argv[k], "--", 2))
+                        continue;
+                if(!fnmatch(zunit_argv[k], name, 0))
+                        return 1;
+                nfilters++;
+        }
+        return !nfilters;
+}
+
+inline static void zunit_result(const char *what, const char *name)
+{
+        if(!zunit_results)
+                return;
+        fprintf(zunit_results, "%s\t%s\n", what, name);
+        fflush(zunit_results);
+}
+
+/*
+  Timing.  Every test run by zunit_main() is timed, by the wall clock and by
+  the CPU time of its process (including all its threads).  If the program
+  sets zunit_count_allocs to a function counting allocations so far, tests run
+  in-process also report how many they made.
+*/
+
+#ifndef ZUNIT_SLACK_MS
+#define ZUNIT_SLACK_MS 5.0  // smaller regressions are noise
+#endif
+
+static long (*zunit_count_allocs)(void) = NULL;
+static int zunit_show_times = 0;
+static double zunit_threshold = 50; // percent
+
+inline static double zunit_clock_ms(clockid_t clk)
+{
+        struct timespec t;
+        clock_gettime(clk, &t);
+        return 1e3 * t.tv_sec + 1e-6 * t.tv_nsec;
+}
+
+inline static int zunit_outcome(int k, int ok, double wall_ms, double cpu_ms,
+                                long nallocs)
+/* Reports a test's times, and fails it if it has slowed too much. */
+{
+        const char *name = zunit_tests[k].name;
+        double base = zunit_tests[k].base_cpu_ms;
+
+        if(zunit_show_times)
+                note(name, nallocs < 0 ? "%.3f ms wall, %.3f ms CPU" :
+                           "%.3f ms wall, %.3f ms CPU, %ld allocations",
+                           wall_ms, cpu_ms, nallocs);
+
+        if(ok && base >= 0 && cpu_ms > base * (1 + zunit_threshold / 100) &&
+                              cpu_ms > base + ZUNIT_SLACK_MS) {
+                zunit_npass--;
+                ok = chk(0, zunit_tests[k].file, zunit_tests[k].line, name,
+                         "CPU time %.3f ms is over %g%% more than %.3f ms",
+                         cpu_ms, zunit_threshold, base);
+        }
+
+        if(zunit_results) {
+                fprintf(zunit_results, "%s\t%s\t%.3f\t%.3f\t%ld\n",
+                        ok ? "pass" : "fail", name, wall_ms, cpu_ms, nallocs);
+                fflush(zunit_results);
+        }
+        return ok;
+}
+
+inline static void zunit_load_baseline(const char *path)
+/* Reads CPU times from a file in the ZUNIT_RESULTS format (see below). */
+{
+        FILE *f = fopen(path, "r");
+        char line[512], what[16], name[256];
+        double wall_ms, cpu_ms;
+
+        if(!f) {
+                perror(path);
+                exit(1);
+        }
+        while(fgets(line, sizeof line, f)) {
+                if(sscanf(line, "%15s %255s %lf %lf", what, name,
+                                &wall_ms, &cpu_ms) != 4 || strcmp(what, "pass"))
+                        continue;
+                for(int k = 0; k < zunit_ntests; k++)
+                        if(!strcmp(zunit_tests[k].name, name))
+                                zunit_tests[k].base_cpu_ms = cpu_ms;
+        }
+        fclose(f);
+}
+
+/*
+  Benchmarks.  Inside a test,
+
+        BENCH("label", statements ...);
+
+  runs the statements in batches, doubling the batch size until one takes at
+  least ZUNIT_BENCH_NS, then times ZUNIT_BENCH_SAMPLES batches of that size.
+  It prints the time per run (the mean over all batches; then the fastest,
+  median and 99th percentile batches) as a line
+
+        bench: test_name: label: 61.2 ns/op, min 59.8, median 60.7, p99 70.4, n 409600
+
+  which n0run.py collects (see benchmarks() there).  Wrap values the
+  statements compute but do not use in BENCH_KEEP(), so that the compiler
+  cannot drop the code computing them.
+*/
+
+#ifndef ZUNIT_BENCH_NS
+#define ZUNIT_BENCH_NS 250000.0
+#endif
+#ifndef ZUNIT_BENCH_SAMPLES
+#define ZUNIT_BENCH_SAMPLES 101
+#endif
+
+#ifdef __GNUC__
+# define BENCH_KEEP(X) __asm__ __volatile__("" : : "g"(X) : "memory")
+# define ZUNIT_BARRIER() __asm__ __volatile__("" : : : "memory")
+#else
+# define BENCH_KEEP(X) ((void)(X))
+# define ZUNIT_BARRIER() ((void)0)
+#endif
+
+#define BENCH(LABEL, ...)                                               \
+        do {                                                            \
+                ZunitBench zunit_b_ = { __func__, (LABEL) };            \
+                while(zunit_bench_next(&zunit_b_))                      \
+                        for(size_t zunit_k_ = zunit_b_.batch;           \
+                                   zunit_k_--; ) {                      \
+                                __VA_ARGS__;                            \
+                                ZUNIT_BARRIER();                        \
+                        }                                               \
+        } while(0)
+
+typedef struct {
+        const char *test, *label;
+        size_t batch;     // runs per batch, 0 before the first
+        int nsamples;     // batches timed, or -1 while calibrating
+        double t0, total;
+        double ns_op[ZUNIT_BENCH_SAMPLES];
+} ZunitBench;
+
+inline static int zunit_cmp_double(const void *a, const void *b)
+{
+        double x = *(const double*)a, y = *(const double*)b;
+        return (x > y) - (x < y);
+}
+
+inline static int zunit_bench_next(ZunitBench *b)
+/* Accounts for the batch just run, and says whether to run another. */
+{
+        double dt = 1e6 * zunit_clock_ms(CLOCK_MONOTONIC) - b->t0;
+
+        if(!b->batch) {
+                b->batch = 1;
+                b->nsamples = -1;
+        } else if(b->nsamples < 0) {
+                if(dt < ZUNIT_BENCH_NS)
+                        b->batch *= 2;
+                else
+                        b->nsamples = 0;
+        } else {
+                b->total += dt;
+                b->ns_op[b->nsamples++] = dt / b->batch;
+        }
+
+        if(b->nsamples == ZUNIT_BENCH_SAMPLES) {
+                double *p = b->ns_op;
+                size_t n = ZUNIT_BENCH_SAMPLES * b->batch;
+                qsort(p, ZUNIT_BENCH_SAMPLES, sizeof *p, zunit_cmp_double);
+#define ZUNIT_PCT(P) p[(ZUNIT_BENCH_SAMPLES - 1) * (P) / 100]
+                printf("bench: %s: %s: %.1f ns/op, min %.1f, median %.1f, "
+                       "p99 %.1f, n %zu\n", b->test, b->label, b->total / n,
+                       ZUNIT_PCT(0), ZUNIT_PCT(50), ZUNIT_PCT(99), n);
+#undef ZUNIT_PCT
+                return 0;
+        }
+
+        b->t0 = 1e6 * zunit_clock_ms(CLOCK_MONOTONIC);
+        return 1;
+}
+
+/*
+  Forked tests.  The process calling zunit_main() is the zygote: each child
+  starts with whatever it set up, runs one test, and exits.  Its stdout and
+  stderr are collected through pipes, then copied to ours in the order the
+  tests were registered, whichever child finishes first.
+*/
+
+typedef struct {
+        int k;           // the test, in zunit_tests
+        pid_t pid;
+        int fd[2];       // reading the child's stdout and stderr, or -1
+        char *text[2];   // and what was read from them
+        size_t size[2];
+        int status;
+        int done;
+        double wall_ms, cpu_ms;
+} ZunitChild;
+
+inline static void zunit_child(int k, int out, int err)
+/* In the child: run test k with its output going to the given pipes. */
+{
+        dup2(out, 1);
+        dup2(err, 2);
+        zunit_results = NULL; // the parent reports
+
+        int ok = zunit_tests[k].fn();
+        int xstatus = zunit_tests[k].xstatus;
+        if(xstatus >= 0)
+                chk(0, zunit_tests[k].file, zunit_tests[k].line,
+                       zunit_tests[k].name, "did not exit with %d", xstatus);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(xstatus >= 0 ? (xstatus + 1) & 255 : !ok);
+}
+
+inline static void zunit_start(ZunitChild *c, int k)
+{
+        int out[2], err[2];
+        if(pipe(out) || pipe(err)) {
+                perror("0unit: pipe");
+                abort();
+        }
+
+        fflush(stdout);  // else the child would write our buffers too
+        fflush(stderr);
+        *c = (ZunitChild){ .k = k, .fd = { out[0], err[0] },
+                           .wall_ms = zunit_clock_ms(CLOCK_MONOTONIC) };
+        if((c->pid = fork()) < 0) {
+                perror("0unit: fork");
+                abort();
+        }
+        if(!c->pid) {
+                close(out[0]);
+                close(err[0]);
+                zunit_child(k, out[1], err[1]);
+        }
+        close(out[1]);
+        close(err[1]);
+}
+
+inline static int zunit_collect(ZunitChild *c, int n)
+/* Waits for output from children c[0 ... n-1], and reaps any that finish.
+   Returns the number that did. */
+{
+        struct pollfd pfd[2 * n];
+        int npfd = 0, ndone = 0;
+        char buf[4096];
+
+        for(int k = 0; k < n; k++)
+                for(int j = 0; j < 2; j++)
+                        if(c[k].fd[j] >= 0)
+                                pfd[npfd++] = (struct pollfd){ c[k].fd[j], POLLIN };
+        if(npfd && poll(pfd, npfd, -1) < 0)
+                return 0; // EINTR, try again
+
+        for(int k = 0; k < n; k++) {
+                for(int j = 0; j < 2; j++) {
+                        int fd = c[k].fd[j];
+                        int p;
+                        for(p = 0; p < npfd && pfd[p].fd != fd; p++)
+                                ;
+                        if(fd < 0 || p == npfd || !pfd[p].revents)
+                                continue;
+
+                        ssize_t nr = read(fd, buf, sizeof buf);
+                        if(nr <= 0) {
+                                close(fd);
+                                c[k].fd[j] = -1;
+                                continue;
+                        }
+                        char *text = realloc(c[k].text[j], c[k].size[j] + nr);
+                        if(!text) {
+                                perror("0unit: collecting output");
+                                abort();
+                        }
+                        memcpy(text + c[k].size[j], buf, nr);
+                        c[k].text[j] = text;
+                        c[k].size[j] += nr;
+                }
+
+                if(c[k].done || c[k].fd[0] >= 0 || c[k].fd[1] >= 0)
+                        continue;
+                struct rusage ru;
+                wait4(c[k].pid, &c[k].status, 0, &ru);
+                c[k].wall_ms = zunit_clock_ms(CLOCK_MONOTONIC) - c[k].wall_ms;
+                c[k].cpu_ms = 1e3 * (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+                              1e-3 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+                c[k].done = 1;
+                ndone++;
+        }
+        return ndone;
+}
+
+inline static int zunit_finish(ZunitChild *c)
+/* Copies the output of a finished child, and says if its test passed. */
+{
+        int k = c->k, xstatus = zunit_tests[k].xstatus;
+        int exited = WIFEXITED(c->status), code = WEXITSTATUS(c->status);
+        int ok = exited && code == (xstatus >= 0 ? xstatus : 0);
+
+        fwrite(c->text[0], 1, c->size[0], stdout);
+        fflush(stdout);
+        if(!ok || xstatus < 0)
+                fwrite(c->text[1], 1, c->size[1], stderr);
+        free(c->text[0]);
+        free(c->text[1]);
+
+        if(ok && xstatus >= 0)
+                pass(zunit_tests[k].name);
+        else if(ok)
+                zunit_npass++;
+        else if(exited && code == (xstatus >= 0 ? (xstatus + 1) & 255 : 1))
+                zunit_nfail++; // the child has said why
+        else if(exited)
+                chk(0, zunit_tests[k].file, zunit_tests[k].line,
+                       zunit_tests[k].name, "exited with %d", code);
+        else
+                chk(0, zunit_tests[k].file, zunit_tests[k].line,
+                       zunit_tests[k].name, "killed by signal %d",
+                       WTERMSIG(c->status));
+
+        return zunit_outcome(k, ok, c->wall_ms, c->cpu_ms, -1);
+}
+
+inline static int zunit_run_forked(const int *tests, int n, int njobs)
+/* Runs the tests, up to njobs at a time.  Returns the number that failed. */
+{
+        ZunitChild c[n > 0 ? n : 1];
+        int nstarted = 0, ndone = 0, nfinished = 0, nfail = 0;
+
+        while(nfinished < n) {
+                while(nstarted < n && nstarted - ndone < njobs)
+                        zunit_start(c + nstarted, tests[nstarted]), nstarted++;
+                ndone += zunit_collect(c, nstarted);
+                while(nfinished < nstarted && c[nfinished].done)
+                        nfail += !zunit_finish(c + nfinished++);
+        }
+        return nfail;
+}
+
+/*
+  zunit_main(argc, argv) runs the registered tests whose names match any of the
+  arguments not starting with "--" (as shell patterns, see fnmatch(3)), or all
+  of them if there are none.  Other arguments are left for the caller, except
+
+        --list    print the names of the registered tests, then exit(0).
+        --fork    run every test in its own child process, as many at once as
+                  there are CPUs.
+        --jobs=N  the same, but N at once.
+        --times   print (as a note) the times of each test.
+        --baseline=FILE
+                  fail tests whose CPU time is more than a threshold over that
+                  in FILE, which is in the ZUNIT_RESULTS format below (so save
+                  that from a good run).  Regressions of under ZUNIT_SLACK_MS
+                  are always allowed, since timing short tests is noisy.
+        --threshold=PCT
+                  the threshold, as a percentage (by default 50).
+
+  If the environment variable ZUNIT_RESULTS names a file, a line
+
+        test    <name>     is written there for each registered test, then
+        pass    <name>  <wall ms>  <CPU ms>  <allocations>  or
+        fail    <name>  <wall ms>  <CPU ms>  <allocations>
+                           as each test that zunit_main() runs finishes.
+
+  (The fields are separated by a tab, allocations is -1 if not counted.)  This
+  lets a test runner like n0run.py know the tests without reading the source.
+  Returns the number that failed.
+*/
+inline static int zunit_main(int argc, const char **argv)
+{
+        int nfail = 0, njobs = 0;
+
+        zunit_argc = argc;
+        zunit_argv = argv;
+        for(int k = 1; k < argc; k++) {
+                if(!strcmp(argv[k], "--fork"))
+                        njobs = sysconf(_SC_NPROCESSORS_ONLN);
+                if(!strncmp(argv[k], "--jobs=", 7))
+                        njobs = atoi(argv[k] + 7);
+                if(!strcmp(argv[k], "--times"))
+                        zunit_show_times = 1;
+                if(!strncmp(argv[k], "--baseline=", 11))
+                        zunit_load_baseline(argv[k] + 11);
+                if(!strncmp(argv[k], "--threshold=", 12))
+                        zunit_threshold = atof(argv[k] + 12);
+                if(strcmp(argv[k], "--list"))
+                        continue;
+                for(int j = 0; j < zunit_ntests; j++)
+                        printf("%s\n", zunit_tests[j].name);
+                exit(0);
+        }
+
+        const char *path = getenv("ZUNIT_RESULTS");
+        if(path && !zunit_results && !(zunit_results = fopen(path, "w")))
+                perror(path);
+        for(int k = 0; k < zunit_ntests; k++)
+                zunit_result("test", zunit_tests[k].name);
+
+        int tests[zunit_ntests + 1], ntests = 0;
+        for(int k = 0; k < zunit_ntests; k++)
+                if(zunit_tests[k].fn && zunit_selected(zunit_tests[k].name))
+                        tests[ntests++] = k;
+        if(njobs > 0)
+                return zunit_run_forked(tests, ntests, njobs);
+
+        for(int t = 0; t < ntests; t++) {
+                int k = tests[t];
+                if(zunit_tests[k].xstatus >= 0) {
+                        nfail += zunit_run_forked(&k, 1, 1);
+                        continue;
+                }
+                long nallocs = zunit_count_allocs ? zunit_count_allocs() : -1;
+                double wall_ms = zunit_clock_ms(CLOCK_MONOTONIC);
+                double cpu_ms = zunit_clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+
+                int ok = zunit_tests[k].fn();
+
+                wall_ms = zunit_clock_ms(CLOCK_MONOTONIC) - wall_ms;
+                cpu_ms = zunit_clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu_ms;
+                if(zunit_count_allocs)
+                        nallocs = zunit_count_allocs() - nallocs;
+                nfail += !zunit_outcome(k, ok, wall_ms, cpu_ms, nallocs);
+        }
+        return nfail;
+}
+
 #endif /* _ZUNIT_H */
@@ -0,0 +1,254 @@
+/*----------------------------------------------------------------------------
+  bench_elm.c: microbenchmarks for the elm primitives.
+
+  Usage: elm-bench [NAME ...]
+
+  Runs each benchmark (or only those named) and writes one JSON object per
+  line to standard output:
+
+        {"bench": "error", "n": 409600, "ns_op": 61.2, "min": 59.8,
+         "p50": 60.7, "p90": 63.0, "p99": 70.4, "allocs_op": 0.00}
+
+  Each benchmark is timed over NSAMPLES batches of `n / NSAMPLES` operations,
+  the batch size being chosen so that a batch takes at least BATCH_NS.
+  ns_op is the mean over all batches, min ... p99 are percentiles of the
+  per-batch means, and allocs_op counts calls to malloc(), calloc() and
+  realloc().
+
+  Copyright (C) 2012, Adrian Ratnapala, under the ISC license. See file LICENSE.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elm.h"
+
+#define NSAMPLES 101
+#define BATCH_NS 1000000
+
+// -- Counting allocations (this relies on glibc's malloc being replaceable).
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+
+static size_t nallocs;
+
+void *malloc(size_t n)
+{
+        __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+        return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+        __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+        return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n)
+{
+        __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+        return __libc_realloc(p, n);
+}
+
+// -- The benchmarks.  Each runs its operation n times.
+
+typedef struct Bench Bench;
+struct Bench {
+        const char *name;
+        void (*run)(Bench *b, size_t n);
+        Logger *lg;
+        size_t size;
+        int fd;  // a standard stream to silence while benchmarking
+};
+
+static void run_error(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++)
+                destroy_error(ERROR("bad token %zu at %s", k, "here"));
+}
+
+static void run_lazy_error(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++)
+                destroy_error(LAZY_ERROR("bad token %zu at %s", k, "here"));
+}
+
+static void run_io_error(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++)
+                destroy_error(IO_ERROR("bench.txt", ENOENT, "opening"));
+}
+
+static void run_try(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++) {
+                PanicReturn ret;
+                Error *err = TRY(ret);
+                if(!err)
+                        NO_WORRIES(ret);
+        }
+}
+
+static void run_try_panic(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++) {
+                PanicReturn ret;
+                Error *err = TRY(ret);
+                if(!err) {
+                        PANIC("bench");
+                        NO_WORRIES(ret);
+                }
+                destroy_error(err);
+        }
+}
+
+static void run_log_f(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++)
+                LOG_F(b->lg, "message %zu of %s", k, "bench");
+}
+
+static void run_log_error(Bench *b, size_t n)
+{
+        Error *err = ERROR("bad token %d at %s", 42, "here");
+        for(size_t k = 0; k < n; k++)
+                log_error(b->lg, err);
+        destroy_error(err);
+}
+
+static void run_malloc(Bench *b, size_t n)
+{
+        for(size_t k = 0; k < n; k++)
+                free(MALLOC(b->size));
+}
+
+static Bench benches[] = {
+        { "error",           run_error },
+        { "lazy_error",      run_lazy_error },
+        { "io_error",        run_io_error },
+        { "try",             run_try },
+        { "try_panic",       run_try_panic },
+        { "log_f_null",      run_log_f,     null_log },
+        { "log_f_file",      run_log_f },
+        { "log_f_std",       run_log_f,     std_log, 0, 1 },
+        { "log_f_dbg",       run_log_f,     dbg_log, 0, 2 },
+        { "log_error_file",  run_log_error },
+        { "malloc_16",       run_malloc,    NULL, 16 },
+        { "malloc_256",      run_malloc,    NULL, 256 },
+        { "malloc_4096",     run_malloc,    NULL, 4096 },
+        { "malloc_65536",    run_malloc,    NULL, 65536 },
+        { "malloc_1048576",  run_malloc,    NULL, 1048576 },
+};
+
+// -- Timing
+
+static double now_ns()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return 1e9 * t.tv_sec + t.tv_nsec;
+}
+
+static double time_batch(Bench *b, size_t n)
+{
+        double t0 = now_ns();
+        b->run(b, n);
+        return now_ns() - t0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double*)a, y = *(const double*)b;
+        return (x > y) - (x < y);
+}
+
+static void run_bench(Bench *b, FILE *out)
+{
+        double per_op[NSAMPLES], total = 0;
+        size_t batch = 1;
+
+        while(time_batch(b, batch) < BATCH_NS)
+                batch *= 2;
+
+        size_t nallocs0 = __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+        for(int k = 0; k < NSAMPLES; k++) {
+                double dt = time_batch(b, batch);
+                total += dt;
+                per_op[k] = dt / batch;
+        }
+        size_t nops = NSAMPLES * batch;
+        double allocs = __atomic_load_n(&nallocs, __ATOMIC_RELAXED) - nallocs0;
+
+        qsort(per_op, NSAMPLES, sizeof per_op[0], cmp_double);
+#define PCT(P) per_op[(NSAMPLES - 1) * (P) / 100]
+        fprintf(out, "{\"bench\": \"%s\", \"n\": %zu, \"ns_op\": %.1f, "
+               "\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+               "\"allocs_op\": %.2f}\n", b->name, nops, total / nops,
+               PCT(0), PCT(50), PCT(90), PCT(99), allocs / nops);
+#undef PCT
+}
+
+static void run_silenced(Bench *b)
+/* Runs b with its standard stream sent to /dev/null. */
+{
+        int null_fd = -1, saved_fd;
+
+        fflush(stdout);
+        fflush(stderr);
+        if((saved_fd = dup(b->fd)) < 0 ||
+           (null_fd = open("/dev/null", O_WRONLY)) < 0)
+                SYS_PANIC(errno, "silencing fd %d", b->fd);
+        dup2(null_fd, b->fd);
+        close(null_fd);
+
+        // report to the real stdout, even if it is silenced.
+        FILE *out = b->fd != 1 ? stdout : fdopen(saved_fd, "w");
+        if(!out)
+                SYS_PANIC(errno, "silencing fd %d", b->fd);
+
+        run_bench(b, out);
+        fflush(b->fd == 1 ? stdout : stderr);
+        fflush(out);
+
+        dup2(saved_fd, b->fd);
+        if(out != stdout)
+                fclose(out);
+        else
+                close(saved_fd);
+}
+
+int main(int argc, const char **argv)
+{
+        FILE *file = tmpfile();
+        if(!file)
+                SYS_PANIC(errno, "creating a temporary file");
+        Logger *file_log = new_logger("bench", file, "");
+
+        for(Bench *b = benches; b < benches + sizeof benches / sizeof *b; b++) {
+                int wanted = argc <= 1;
+                for(int k = 1; k < argc; k++)
+                        wanted |= !strcmp(argv[k], b->name);
+                if(!wanted)
+                        continue;
+
+                if(!b->lg && b->run != run_malloc)
+                        b->lg = file_log;
+                if(b->fd)
+                        run_silenced(b);
+                else
+                        run_bench(b, stdout);
+                fflush(stdout);
+        }
+
+        panic_if(destroy_logger(file_log));
+        fclose(file);
+        return 0;
+}
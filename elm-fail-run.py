@@ -7,7 +7,8 @@
   pass.  But used as a module, it provides classes that can be extended to do
   more complicated things.  This program is written specifically for doctored
   versions of the elm unit tests, which we hope will fail or die in specific
-  ways.
+  ways.  It also runs the undoctored tests, which should all pass; all these
+  runs happen concurrently (see run_parallel in n0run.py).
 
   Copyright (C) 2012, Adrian Ratnapala, under the ISC license. See file LICENSE.
 """
@@ -22,6 +23,8 @@ class Elm_Fail_Runner(Fail_Runner) :
                 ('NOMEM', br'^NOMEM \(in test_elm.c:(?P<n>test_malloc+)'),
                 ('LOGFAILED', br'^LOGFAILED \(in test_elm.c:(?P<n>test_logging)\)'),
                 ('LOGFAILED', br'^LOGFAILED \(in test_elm.c:(?P<n>test_debug_logger)\)'),
+                # the crash ring, dumped when the process dies
+                ('RECENT', br'^RECENT( [A-Z]+)? \(in [^:]+:[0-9]+:(?P<n>\w+)\): '),
         ])
 
         def __init__(s, command, source) :
@@ -74,12 +77,57 @@ class Elm_Fail_Panic_Runner(Panic_Runner) :
 
 
 
+class Elm_Baseline_Runner(Fail_Runner) :
+        err_matchers = []
+
+        def __init__(s, command, source, baseline) :
+                Fail_Runner.__init__(s, [command, '--baseline=' + baseline.name,
+                                         'test_error_speed'], source, xerrno=1)
+
+
+def slow_baseline() :
+        """
+        A baseline file (see --baseline in 0unit.h) in which test_error_speed
+        took no time at all, so that it must now seem to have regressed.
+        """
+        from tempfile import NamedTemporaryFile
+        f = NamedTemporaryFile(prefix='elm-baseline-')
+        f.write(b'pass\ttest_error_speed\t0\t0\t-1\n')
+        f.flush()
+        return f
+
+
 if __name__ == "__main__":
         from sys import stdout, stderr
 
+        baseline = slow_baseline()
+        runners = run_parallel([
+                lambda : Runner(['./elm-test', '--fork'], 'test_elm.c'),
+                lambda : Elm_Panic_Runner('./elm-test', 'test_elm.c'),
+                lambda : Elm_Panic_Runner('./elm-test', 'test_elm.c', xerrno=13),
+                lambda : Elm_Fail_Panic_Runner('./elm-fail', 'test_elm.c'),
+                lambda : Elm_Fail_Runner('./elm-fail', 'test_elm.c'),
+                lambda : Elm_Baseline_Runner('./elm-test', 'test_elm.c',
+                                             baseline),
+        ])
+
+        print('elm-test ...')
+        results = run_main(runners[0])
+        save_benchmarks(runners[0])
+
+        results.check_found( results.run )
+        results.check_run( results.src )
+        results.check_matched( 'passed', results.run )
+        benched = { b['test'] for b in benchmarks(runners[0].lines) }
+        if benched != {'test_error_speed'} :
+                results.errno = warn("Benchmarks found in {}".format(benched))
+        if results.errno :
+                sys.exit(results.errno)
+        stderr.flush()
+        stdout.flush()
+
         print('elm-test with panic ...')
-        trunner  = Elm_Panic_Runner('./elm-test', 'test_elm.c')
-        tresults = run_main(trunner)
+        tresults = run_main(runners[1])
         results = tresults
 
         results.check_found( results.run - {'main'} )
@@ -91,8 +139,7 @@ if __name__ == "__main__":
         stdout.flush()
 
         print('elm-test with SYS_PANIC ...')
-        trunner  = Elm_Panic_Runner('./elm-test', 'test_elm.c', xerrno=13)
-        tresults = run_main(trunner)
+        tresults = run_main(runners[2])
         results = tresults
 
         results.check_found( results.run - {'main'} )
@@ -106,8 +153,7 @@ if __name__ == "__main__":
 
 
         print('elm-fail with panic ...')
-        prunner  = Elm_Fail_Panic_Runner('./elm-fail', 'test_elm.c')
-        presults = run_main(prunner)
+        presults = run_main(runners[3])
         results = presults
 
         results.check_found( results.run - {'main'} )
@@ -121,8 +167,7 @@ if __name__ == "__main__":
         stdout.flush()
 
         print('elm-fail with out panic ...')
-        runner  = Elm_Fail_Runner('./elm-fail', 'test_elm.c')
-        results = run_main(runner)
+        results = run_main(runners[4])
 
         results.check_found( results.run )
         results.check_run( results.src )
@@ -134,4 +179,13 @@ if __name__ == "__main__":
         stderr.flush()
         stdout.flush()
 
-        sys.exit(results.errno or presults.errno or tresults.errno)
+        print('elm-test against a baseline ...')
+        bresults = run_main(runners[5])
+
+        bresults.check_run( {'test_error_speed'} )
+        bresults.check_matched('FAILED', {'test_error_speed'} )
+        stderr.flush()
+        stdout.flush()
+
+        sys.exit(results.errno or presults.errno or tresults.errno or
+                 bresults.errno)
@@ -12,12 +12,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
-
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
 #ifdef TEST
 #include "0unit.h"
@@ -49,12 +60,41 @@ static void* panic_nomem(const char* file, int line, const char *func)
         return NULL;
 }
 
+/*
+  Errors are recycled through a Pool, so that code which creates and destroys
+  many errors does not keep calling malloc().  Each block has room for a short
+  message, which init_error() uses instead of vasprintf() when it fits.
+*/
+#define ERROR_BLOCK_SIZE 256
+#define ERROR_POOL_NKEEP 64
+
+typedef struct {
+        Error error;  // MUST be first.
+        char  zmsg[ERROR_BLOCK_SIZE - sizeof(Error)];
+} ErrorBlock;
+
+static Pool *error_pool;
+static pthread_once_t error_pool_once = PTHREAD_ONCE_INIT;
+
+static void make_error_pool(void)
+{
+        error_pool = POOL_OF(ErrorBlock, ERROR_POOL_NKEEP);
+}
+
+static int error_msg_is_inline(Error *e)
+{
+        return e->type != nomem_error_type &&
+               e->data == ((ErrorBlock*)e)->zmsg;
+}
+
+static long long clock_ns();
+static long thread_id();
+
 Error *elm_mkerr(const ErrorType *etype, const char *file, int line, const char *func)
-/* malloc()s an error & fills out the metadata. */
+/* Gets an error from the pool & fills out the metadata. */
 {
-        Error* e = malloc(sizeof(Error));
-        if(!e)
-                panic_nomem(file, line, func);
+        pthread_once(&error_pool_once, make_error_pool);
+        Error* e = pool_get_or_die(error_pool, file, line, func);
 
         *e = (Error){
                 .type = etype,
@@ -62,25 +102,30 @@ Error *elm_mkerr(const ErrorType *etype, const char *file, int line, const char
                         .file = file,
                         .line = line,
                         .func = func,
+                        .tid = thread_id(),
+                        .time_ns = clock_ns(),
+                        .level = LOG_LEVEL_ERROR,
                 },
         };
         return e;
 }
 
 void destroy_error(Error *e)
-/* calls an error's cleanup method, and then free()s the error. */
+/* calls an error's cleanup method, and then returns the error to the pool. */
 {
         if(!e)
                 return;
 
         assert(e->type);
-        if(e->type->cleanup)
-                e->type->cleanup(e->data);
-        else
-                free(e->data);
+        if(!error_msg_is_inline(e)) {
+                if(e->type->cleanup)
+                        e->type->cleanup(e->data);
+                else
+                        free(e->data);
+        }
 
         if(e->type != nomem_error_type)
-                free(e);
+                pool_put(error_pool, e);
 }
 
 Error *keep_first_error(Error *one, Error *two)
@@ -111,6 +156,16 @@ const ErrorType *const error_type = &_error_type;
 
 extern Error *init_error_v(Error *e, const char *zfmt, va_list va)
 {
+        char *zinline = ((ErrorBlock*)e)->zmsg;
+        va_list vcopy;
+        va_copy(vcopy, va);
+        int n = vsnprintf(zinline, sizeof ((ErrorBlock*)e)->zmsg, zfmt, vcopy);
+        va_end(vcopy);
+        if(n >= 0 && n < sizeof ((ErrorBlock*)e)->zmsg) {
+                e->data = zinline;
+                return e;
+        }
+
         e->data = (char*)zfmt; // in case of panic
         if( vasprintf((char**)&e->data, zfmt, va) < 0 )
                 panic(e);
@@ -229,9 +284,14 @@ int sys_error(Error *e, char **zname, char **zmsg)
 
 // Raw Stderr -----------------------------------------------------------------
 
+static ssize_t fd_write(int fd, const char *str)
+{
+        return write(fd, str, strlen(str));
+}
+
 static ssize_t emergency_write(const char *str)
 {
-        return write(2, str, strlen(str));
+        return fd_write(2, str);
 }
 
 static int emergency_message(const char *pre, LogMeta *meta, const char *post)
@@ -255,28 +315,117 @@ static int emergency_message(const char *pre, LogMeta *meta, const char *post)
         return n;
 }
 
+// Crash ring ------.
+/*
+  Nothing here takes a lock or formats with stdio, so dump_crash_ring() can run
+  in a signal handler.  A signal arriving mid-note can leave one slot mixing
+  two notes, which is harmless since every field is always a valid value.
+*/
+
+__thread ElmCrashRing _elm_crash_ring;  // written by _elm_crash_note()
+
+void dump_crash_ring(int fd)
+/* Writes the notes of the calling thread, oldest first. */
+{
+        static const char *const zlevel[] = {
+                "RECENT DEBUG", "RECENT INFO", "RECENT WARN", "RECENT ERROR",
+        };
+        unsigned n = _elm_crash_ring.n;
+        unsigned k = n > ELM_CRASH_RING ? n - ELM_CRASH_RING : 0;
+
+        for(; k < n; k++) {
+                ElmCrashNote *c = _elm_crash_ring.note + k % ELM_CRASH_RING;
+                char zline[16], *z = zline + sizeof zline;
+                *--z = 0;
+                unsigned line = c->line > 0 ? c->line : 0;
+                do *--z = '0' + line % 10; while(line /= 10);
+
+                int lvl = c->level;
+                fd_write(fd, lvl >= 0 && lvl < 4 ? zlevel[lvl] : "RECENT");
+                fd_write(fd, " (in ");
+                fd_write(fd, c->file ? c->file : "?");
+                fd_write(fd, ":");
+                fd_write(fd, z);
+                fd_write(fd, ":");
+                fd_write(fd, c->func ? c->func : "?");
+                fd_write(fd, "): ");
+                fd_write(fd, c->fmt ? c->fmt : "");
+                fd_write(fd, "\n");
+        }
+}
+
+static void crash_handler(int sig)
+{
+        dump_crash_ring(2);
+        raise(sig); // the handler was reset by SA_RESETHAND
+}
+
+void install_crash_handlers(void)
+{
+        static const int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+        struct sigaction sa = { .sa_handler = crash_handler,
+                                .sa_flags = SA_RESETHAND | SA_NODEFER };
+        sigemptyset(&sa.sa_mask);
+        for(int k = 0; k < sizeof sigs / sizeof *sigs; k++)
+                if(sigaction(sigs[k], &sa, NULL))
+                        SYS_PANIC(errno, "installing crash handler %d", sigs[k]);
+}
+
 // Logs -----------------------------------------------------------------------
 
 typedef int (*VPrintf)(Logger *lg, LogMeta *meta, const char *msg, va_list va);
-typedef int (*FWritePrefix)(Logger *lg, LogMeta *meta);
+typedef int (*SPrintPrefix)(Logger *lg, LogMeta *meta, char *buf, size_t size);
+
+typedef struct AsyncQueue AsyncQueue;
+typedef struct BinLog BinLog;
+typedef struct MapLog MapLog;
+typedef struct Rotator Rotator;
+typedef struct TeeLog TeeLog;
+
+enum { LOG_STAMP_TIME = 1, LOG_STAMP_TID = 2 };
 
 struct Logger {
         /*Loggers decorate messages, and send them to a stream. Or drop them.*/
+        LogGate gate;         // MUST be first, see log_enabled()
         int  nrefs;
         FILE *stream;         // the output stream
         const char *zname;    // prefix text emitted before each message
+        int stamp;            // LOG_STAMP_* flags: what else goes in the prefix
+        AsyncQueue *async;    // non-NULL if a writer thread owns the stream
+        BinLog *binary;       // non-NULL for binary loggers
+        MapLog *map;          // non-NULL for memory mapped loggers
+        Rotator *rot;         // non-NULL if the stream is rotated
+        TeeLog *tee;          // non-NULL if messages go to other loggers
+        int owns_stream;      // fclose() the stream on destruction
+
+        /* When to fflush(), see logger_flush_policy(). */
+        LogFlush flush;
+        unsigned long flush_n;
+        unsigned long npending;  // lines or bytes written since the last flush
+        long long flushed_at;    // when the last flush happened (milliseconds)
+        Logger *next_lazy;       // in the list flushed by uncaught panics
 
 
         /* User redefinable functions (methods) */
         VPrintf vprintf;
-        FWritePrefix fwrite_prefix;
+        SPrintPrefix sprint_prefix; // snprintf()s the prefix into a buffer
 };
 
 static void init_static_logger(Logger *lg)
-/* Idempotently ensures initialisation of builtin loggers before each use. */
+/* Idempotently ensures initialisation of builtin loggers before each use.  The
+   first thread to see nrefs == 0 sets it to -2 while it works, the others wait
+   for the -1 which says the logger is ready. */
 {
-        if(lg->nrefs)
+        int nrefs = __atomic_load_n(&lg->nrefs, __ATOMIC_ACQUIRE);
+        if(nrefs && nrefs != -2)
+                return;
+        if(nrefs == -2 ||
+           !__atomic_compare_exchange_n(&lg->nrefs, &nrefs, -2, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                while(__atomic_load_n(&lg->nrefs, __ATOMIC_ACQUIRE) == -2)
+                        sched_yield();
                 return;
+        }
 
         switch( (uintptr_t)lg->stream ) {
         case 0: break; /* leave NULL logs alone */
@@ -287,52 +436,259 @@ static void init_static_logger(Logger *lg)
                 break;
         }
 
-        lg->nrefs = -1;
+        __atomic_store_n(&lg->nrefs, -1, __ATOMIC_RELEASE);
+}
+
+static int is_null_logger(Logger *lg)
+{
+        // a rotating logger's stream is only stable under its lock.
+        return !lg->map && !lg->rot && !lg->tee && !lg->stream;
+}
+
+static long long now_ms()
+{
+        struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long clock_ns()
+/* The coarse wall-clock time used in LogMeta. */
+{
+        struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static __thread long _thread_id;
+static pthread_once_t thread_id_once = PTHREAD_ONCE_INIT;
+
+static void forget_thread_id()
+/* A forked child has a new tid, but inherits the forking thread's cache. */
+{
+        _thread_id = 0;
+}
+
+static void watch_forks()
+{
+        pthread_atfork(NULL, NULL, forget_thread_id);
+}
+
+static long thread_id()
+{
+        if(!_thread_id) {
+                pthread_once(&thread_id_once, watch_forks);
+#ifdef SYS_gettid
+                _thread_id = syscall(SYS_gettid);
+#else
+                _thread_id = (long)pthread_self();
+#endif
+        }
+        return _thread_id;
+}
+
+/* Each thread keeps the date string of the last second it stamped, so that
+   strftime() runs at most once a second. */
+static __thread struct {
+        long long sec;
+        char zdate[24];
+} date_cache;
+
+static int sprint_stamp(Logger *lg, LogMeta *meta, char *buf, size_t size)
+/* Format the time and thread-id part of a prefix. */
+{
+        int n = 0;
+        if(lg->stamp & LOG_STAMP_TIME) {
+                long long sec = meta->time_ns / 1000000000;
+                if(sec != date_cache.sec || !date_cache.zdate[0]) {
+                        time_t t = sec;
+                        struct tm tm;
+                        gmtime_r(&t, &tm);
+                        strftime(date_cache.zdate, sizeof date_cache.zdate,
+                                 "%Y-%m-%dT%H:%M:%S", &tm);
+                        date_cache.sec = sec;
+                }
+                n += snprintf(buf, size, "%s.%03dZ ", date_cache.zdate,
+                              (int)(meta->time_ns % 1000000000 / 1000000));
+        }
+        if(lg->stamp & LOG_STAMP_TID)
+                n += snprintf(buf + (n < size ? n : size),
+                              n < size ? size - n : 0, "[%ld] ", meta->tid);
+        return n;
+}
+
+static int flush_due(Logger *lg, int nbytes, int is_error)
+/* Account for a message just written; true if the stream needs a flush. */
+{
+        unsigned long npending;
+
+        switch(lg->flush) {
+        case LOG_FLUSH_ALWAYS:
+                return 1;
+        case LOG_FLUSH_ERRORS:
+                return is_error;
+        case LOG_FLUSH_LINES:
+                nbytes = 1;
+                // fall through
+        case LOG_FLUSH_BYTES:
+                npending = __atomic_add_fetch(&lg->npending, nbytes,
+                                              __ATOMIC_RELAXED);
+                if(npending < lg->flush_n)
+                        return 0;
+                __atomic_store_n(&lg->npending, 0, __ATOMIC_RELAXED);
+                return 1;
+        case LOG_FLUSH_INTERVAL: {
+                long long now = now_ms();
+                if(now - lg->flushed_at < lg->flush_n)
+                        return 0;
+                lg->flushed_at = now;
+                return 1;
+        }}
+
+        return 1;
+}
+
+static int log_prefix(Logger *lg, LogMeta *meta, char *buf, size_t size)
+{
+        int n = lg->stamp ? sprint_stamp(lg, meta, buf, size) : 0;
+        return n + snprintf(buf + (n < size ? n : size),
+                            n < size ? size - n : 0, "%s: ", lg->zname);
+}
+
+static int dbg_prefix(Logger *lg, LogMeta *meta, char *buf, size_t size)
+{
+        int n = lg->stamp ? sprint_stamp(lg, meta, buf, size) : 0;
+        return n + snprintf(buf + (n < size ? n : size),
+                            n < size ? size - n : 0, "%s (%s:%d in %s): ",
+                            lg->zname, meta->file, meta->line, meta->func);
 }
 
-static int log_prefix(Logger *lg, LogMeta *meta)
+#define ELM_LOG_LINE_STACK 512  // longer lines are formatted on the heap
+
+static int fwrite_prefix(Logger *lg, LogMeta *meta)
+/* Send the prefix to lg->stream, formatting it on the stack. */
 {
-        return fprintf(lg->stream, "%s: ", lg->zname);
+        char small[256];
+        int n = lg->sprint_prefix(lg, meta, small, sizeof small);
+        if(n <= 0)
+                return n;
+        if(n < sizeof small)
+                return fwrite(small, 1, n, lg->stream);
+
+        char big[n + 1];
+        lg->sprint_prefix(lg, meta, big, n + 1);
+        return fwrite(big, 1, n, lg->stream);
 }
 
-static int dbg_prefix(Logger *lg, LogMeta *meta)
+static char *format_line(Logger *lg, LogMeta *meta, const char *msg,
+                         va_list va, char *small, size_t nsmall, size_t *n)
+/* Formats a whole line (prefix, message and '\n') into `small`, or if it won't
+   fit, into a MALLOC()ed buffer.  Returns the line or NULL on failure. */
 {
-        return fprintf(lg->stream, "%s (%s:%d in %s): ",
-                lg->zname, meta->file, meta->line, meta->func);
+        va_list vcopy;
+
+        int nprefix = lg->sprint_prefix(lg, meta, small, nsmall);
+        size_t nfit = nprefix < nsmall ? nprefix : nsmall;
+        va_copy(vcopy, va);
+        int nbody = vsnprintf(small + nfit, nsmall - nfit, msg, vcopy);
+        va_end(vcopy);
+        if(nprefix < 0 || nbody < 0)
+                return NULL;
+
+        *n = nprefix + nbody + 1;
+        if(*n <= nsmall) {
+                small[*n - 1] = '\n';
+                return small;
+        }
+
+        char *big = MALLOC(*n);
+        lg->sprint_prefix(lg, meta, big, *n);
+        vsnprintf(big + nprefix, *n - nprefix, msg, va);
+        big[*n - 1] = '\n';
+        return big;
 }
 
 static int log_vprintf(Logger *lg, LogMeta *meta, const char *msg, va_list va)
-/* method: format a message vprintf style, then log it. */
+/* method: format a message vprintf style, then log it.  The line is sent in
+   one fwrite(), so that lines from different threads do not interleave. */
 {
         init_static_logger(lg);
 
-        int nprefix = lg->fwrite_prefix(lg, meta);
-        if ( nprefix <= 0 )
-                goto no_write;
-
-        int nbody = vfprintf(lg->stream, msg, va);
-        if ( nbody <= 0 )
+        char small[ELM_LOG_LINE_STACK];
+        size_t n, nw = 0;
+        char *line = format_line(lg, meta, msg, va, small, sizeof small, &n);
+        if(!line)
                 goto no_write;
 
-        if ( fputc('\n', lg->stream) == EOF)
+        nw = fwrite(line, 1, n, lg->stream);
+        if(line != small)
+                free(line);
+        if(nw < n)
                 goto no_write;
 
-        if( fflush(lg->stream) == EOF )
+        if( flush_due(lg, n, 0) && fflush(lg->stream) == EOF )
                 goto no_write;
 
         if(!FAKE_FAIL)
-                return nbody + nprefix + 1;
+                return n;
 
 no_write:
         emergency_message("LOGFAILED", meta, msg);
         return -1;
 }
 
+static int meta_printf(Logger *lg, LogMeta *meta, const char *msg, ...)
+/* Call the vprintf method with explicit metadata. */
+{
+        va_list va;
+        va_start(va, msg);
+        int n = lg->vprintf(lg, meta, msg, va);
+        va_end(va);
+        return n;
+}
+
+static int vprintf_error(Logger *lg, Error *err)
+/* log_error() for loggers that do not write straight to their stream.  The
+   error text is rendered into memory, then passed on to the vprintf method. */
+{
+        char *text = NULL;
+        size_t size = 0;
+        FILE *mstream = open_memstream(&text, &size);
+        if(!mstream)
+                goto no_write;
+
+        int nbody = error_fwrite(err, mstream);
+        if(fclose(mstream) == EOF || nbody < 0)
+                goto no_write;
+
+        int n = meta_printf(lg, &err->meta, "%s", text);
+        free(text);
+        return n;
+
+no_write:
+        free(text);
+        if(errno == ENOMEM)
+                panic_nomem(err->meta.file,
+                            err->meta.line,
+                            err->meta.func
+                           );
+        emergency_message("LOGFAILED", &err->meta, "Error logging error.");
+        return -1;
+}
+
 int log_error(Logger *lg, Error *err)
 /* Convert an error to a string, then log it. Metadata come from the error. */
 {
         init_static_logger(lg);
-        if(!lg->stream) // is this a null log?
+        if(is_null_logger(lg))
                 return 0;
 
 
@@ -341,24 +697,24 @@ int log_error(Logger *lg, Error *err)
         if(etype == nomem_error_type)
                 return etype->fwrite(err, lg->stream /* probably ignored */);
 
+        if(lg->vprintf != log_vprintf)
+                return vprintf_error(lg, err);
 
-        if(FAKE_FAIL)
+        if(FAKE_FAIL) {
+                errno = EIO; // as a real write error would, not a stale ENOMEM
                 goto no_write;
+        }
 
-        int nprefix = lg->fwrite_prefix(lg, &err->meta);
-        if ( nprefix <= 0 )
-                goto no_write;
-
-        // ask the error to write its own text
-        int nbody = error_fwrite(err, lg->stream);
-        if(nbody < 0)
-                goto no_write;
-
-
-        if ( fputc('\n', lg->stream) == EOF)
+        // the error writes its own text, so hold the stream to keep it whole.
+        flockfile(lg->stream);
+        int nprefix = fwrite_prefix(lg, &err->meta);
+        int nbody = nprefix > 0 ? error_fwrite(err, lg->stream) : -1;
+        int nl = nbody >= 0 ? fputc('\n', lg->stream) : EOF;
+        funlockfile(lg->stream);
+        if(nl == EOF)
                 goto no_write;
 
-        if( fflush(lg->stream) == EOF )
+        if( flush_due(lg, nbody + nprefix + 1, 1) && fflush(lg->stream) == EOF )
                 goto no_write;
 
         return nbody + nprefix + 1;
@@ -375,214 +731,2458 @@ no_write:
 
 // A handful of builtin loggers are statically allocated.
 Logger _elm_std_log = {
+        gate    : { threshold : LOG_LEVEL_DEBUG },
         stream  : (FILE*)1,
         zname   : "LOG",
         vprintf : log_vprintf,
-        fwrite_prefix : log_prefix,
+        sprint_prefix : log_prefix,
 };
 
 Logger _elm_err_log = {
+        gate    : { threshold : LOG_LEVEL_DEBUG },
         stream  : (FILE*)2,
         zname   : "ERROR",
         vprintf : log_vprintf,
-        fwrite_prefix : log_prefix,
+        sprint_prefix : log_prefix,
 };
 
 Logger _elm_dbg_log = {
+        gate    : { threshold : LOG_LEVEL_DEBUG },
         stream  : (FILE*)2,
         zname : "DBG",
         vprintf : log_vprintf,
-        fwrite_prefix : dbg_prefix,
+        sprint_prefix : dbg_prefix,
 };
 
 Logger _elm_null_log = {
+        gate    : { threshold : LOG_LEVEL_OFF },
         stream  : (FILE*)0,
         zname : "NULL",
         vprintf : log_vprintf,
-        fwrite_prefix : dbg_prefix,
+        sprint_prefix : dbg_prefix,
 };
 
 
-// User created loggers ------.
+// Asynchronous loggers ------.
+/*
+  An asynchronous logger formats each message straight into a slot of a
+  preallocated ring, and a writer thread drains the ring to the stream in large
+  batches.  The ring is a bounded multi-producer queue after D. Vyukov: every
+  slot carries a sequence number saying whether it is free for the producer
+  which reserves position `pos` (seq == pos), or ready for the writer (seq ==
+  pos + 1).  Producers never lock; the mutex only puts an idle writer to sleep.
+*/
 
-Logger *new_logger(const char *zname, FILE *stream, const char *opts)
-/* Create a standard logger that writes to "stream". */
-{
-        FWritePrefix fwp = log_prefix;
+#ifndef ELM_ASYNC_NSLOTS
+#define ELM_ASYNC_NSLOTS 1024   // must be a power of two
+#endif
 
-        if(opts) {
-                int ch;
-                for(const char *o=opts; ch=*o; o++) switch(ch) {
-                case 'd': fwp = dbg_prefix; continue;
-                }
-        }
+#ifndef ELM_ASYNC_LINE_MAX
+#define ELM_ASYNC_LINE_MAX 512  // longer messages are truncated
+#endif
 
-        Logger *lg = malloc( sizeof(Logger) );
-        if( !lg )
-                PANIC_NOMEM();
+#define ASYNC_BATCH_MAX (64 * 1024)
 
-        assert(zname);
+typedef struct {
+        size_t seq;
+        int    len;
+        char   text[ELM_ASYNC_LINE_MAX];
+} AsyncSlot;
 
-        lg->stream  = stream;
-        lg->vprintf = log_vprintf;
-        lg->fwrite_prefix = fwp;
-        lg->zname = strdup(zname);
+struct AsyncQueue {
+        Logger     *lg;
+        int         drop;       // drop messages (rather than block) if full?
 
-        lg->nrefs = 1;
-        return lg;
-}
+        size_t head __attribute__((aligned(64))); // next position to reserve
+        size_t ndropped;        // messages dropped because the ring was full
 
-Logger *ref_logger(Logger *lg)
+        size_t tail __attribute__((aligned(64))); // next position to drain
+        size_t nflushed;        // positions written and fflush()ed
+        size_t nreported;       // dropped messages the log has been told of
+
+        pthread_t       writer;
+        pthread_mutex_t lock;
+        pthread_cond_t  wake;
+        int             sleeping, stop;
+
+        char       batch[ASYNC_BATCH_MAX];
+        AsyncSlot  slots[ELM_ASYNC_NSLOTS];
+};
+
+static AsyncSlot *async_slot(AsyncQueue *q, size_t pos)
 {
-        int nrefs = lg->nrefs;
-        if(nrefs > 0)
-                lg->nrefs = ++nrefs;
-        return lg;
+        return q->slots + (pos & (ELM_ASYNC_NSLOTS - 1));
 }
 
-Error *destroy_logger(Logger *lg)
-/* Frees a non-builtin logger. */
+static int async_ready(AsyncQueue *q)
 {
-        if(!lg)
-                return NULL;
-        int nrefs = lg->nrefs;
-        if(nrefs <= 0) // static logger, do not touch.
-                return NULL;
-        if(--nrefs) {
-                lg->nrefs = nrefs;
-                return NULL;
-        }
-
-        free((char*)lg->zname);
-        free(lg);
-        return NULL;
+        size_t pos = q->tail;
+        return __atomic_load_n(&async_slot(q, pos)->seq, __ATOMIC_ACQUIRE)
+                == pos + 1;
 }
 
-
-int log_f(Logger *lg,
-           const char *file,
-           int         line,
-           const char *func,
-           const char *msg, ...)
-/* Format a message vprintf style, then log it. */
+static void async_wake(AsyncQueue *q)
+/* Rouse the writer if it is asleep. */
 {
-        va_list va;
-        int n;
-        init_static_logger(lg);
-        if(!lg->stream) // is this a null log?
-                return 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED))
+                return;
 
-        assert(lg);
-        va_start(va, msg);
-                LogMeta m = {
-                file : file,
-                line : line,
-                func : func,
-        };
-        n = lg->vprintf(lg, &m, msg, va);
-        va_end(va);
-        return n;
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->wake);
+        pthread_mutex_unlock(&q->lock);
 }
 
+static AsyncSlot *async_reserve(AsyncQueue *q, size_t *ppos)
+/* Claim the next free slot; returns NULL only if the ring is full and q->drop.*/
+{
+        size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        for(;;) {
+                AsyncSlot *s = async_slot(q, pos);
+                size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+                intptr_t dif = (intptr_t)(seq - pos);
+
+                if(!dif) {
+                        if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+                                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                                *ppos = pos;
+                                return s;
+                        }
+                        continue; // the failed CAS reloaded pos
+                }
 
+                if(dif < 0) { // full
+                        if(q->drop) {
+                                __atomic_add_fetch(&q->ndropped, 1,
+                                                   __ATOMIC_RELAXED);
+                                return NULL;
+                        }
+                        async_wake(q);
+                        sched_yield();
+                }
+                pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+}
 
-// Malloc ---------------------------------------------------------------------
-/*
-        A malloc() wrapper that checks the results and exits on failure, after
-        printing an error message to stderr.  These are macros, not functions,
-        because they gather source-location metadata.
+static int async_vprintf(Logger *lg, LogMeta *meta, const char *msg, va_list va)
+/* method: format a message into the ring, for the writer thread to send. */
+{
+        AsyncQueue *q = lg->async;
+        size_t pos;
+        AsyncSlot *s = async_reserve(q, &pos);
+        if(!s)
+                return 0;
 
-        MALLOC(N)     - Allocate N bytes (or die trying).
-        ZALLOC(N)     - Allocate N zeroed bytes.
-        PANIC_NOMEM() - Called when malloc fails.
+        int n = lg->sprint_prefix(lg, meta, s->text, ELM_ASYNC_LINE_MAX);
+        if(n >= 0 && n < ELM_ASYNC_LINE_MAX) {
+                int nbody = vsnprintf(s->text + n, ELM_ASYNC_LINE_MAX - n,
+                                      msg, va);
+                n = nbody < 0 ? -1 : n + nbody;
+        }
 
-        You can call PANIC_NOMEM yourself, if detect an out of memory
-        condition.  Or if you want to supply your own metadata, you can call
+        // the slot must be published even if formatting failed
+        int len = n < 0 ? 0 : n < ELM_ASYNC_LINE_MAX ? n : ELM_ASYNC_LINE_MAX-1;
+        if(len)
+                s->text[len++] = '\n';
+        s->len = len;
+        __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+        async_wake(q);
 
-        void panic_nomem(const char* file, int line, const char *func)
+        if(n < 0) {
+                emergency_message("LOGFAILED", meta, msg);
+                return -1;
+        }
+        return len;
+}
 
-        In future, the exit might not be unconditional.  The panic might
-        conditionally do a longjmp to a place where you can try to carry on.
-*/
+static void async_write(AsyncQueue *q, size_t nbatch)
+{
+        if(nbatch && fwrite(q->batch, 1, nbatch, q->lg->stream) != nbatch)
+                emergency_message("LOGFAILED", NULL, "Asynchronous write failed.");
+}
 
-static int nomem_fwrite(Error *e, FILE *out);
+static size_t async_drain(AsyncQueue *q)
+/* Writer thread: send every ready slot to the stream, return how many. */
+{
+        size_t nbatch = 0, pos = q->tail;
+
+        size_t ndropped = __atomic_load_n(&q->ndropped, __ATOMIC_RELAXED);
+        if(ndropped != q->nreported) {
+                int n = snprintf(q->batch, ELM_ASYNC_LINE_MAX,
+                        "%s: %zu messages dropped\n",
+                        q->lg->zname, ndropped - q->nreported);
+                nbatch = n < 0 ? 0 : n < ELM_ASYNC_LINE_MAX ? n : 0;
+                q->nreported = ndropped;
+        }
 
-static const ErrorType _nomem_error_type = {
-        fwrite    : nomem_fwrite,
-        cleanup   : NULL,
-};
+        for(;; pos++) {
+                AsyncSlot *s = async_slot(q, pos);
+                if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+                        break;
 
-const ErrorType *const nomem_error_type = &_nomem_error_type;
+                if(nbatch + s->len > ASYNC_BATCH_MAX) {
+                        async_write(q, nbatch);
+                        nbatch = 0;
+                }
+                memcpy(q->batch + nbatch, s->text, s->len);
+                nbatch += s->len;
+                __atomic_store_n(&s->seq, pos + ELM_ASYNC_NSLOTS,
+                                 __ATOMIC_RELEASE);
+        }
 
-static Error nomem_error =  {
-        .type = &_nomem_error_type,
-        .meta = {
-                .line = -1,
-                .file = "",
-                .func = "",
+        size_t ndrained = pos - q->tail;
+        q->tail = pos;
+        if(nbatch) {
+                async_write(q, nbatch);
+                if(fflush(q->lg->stream) == EOF)
+                        emergency_message("LOGFAILED", NULL,
+                                          "Asynchronous flush failed.");
         }
-};
+        __atomic_store_n(&q->nflushed, pos, __ATOMIC_RELEASE);
+        return ndrained;
+}
 
-static int nomem_fwrite(Error *e, FILE *out)
+static void *async_writer(void *arg)
 {
-        return emergency_message("NOMEM", &nomem_error.meta, "Out of virtual memory");
+        AsyncQueue *q = arg;
+        for(;;) {
+                if(async_drain(q))
+                        continue;
+
+                pthread_mutex_lock(&q->lock);
+                __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+                int stop = q->stop;
+                if(!stop && !async_ready(q))
+                        pthread_cond_wait(&q->wake, &q->lock);
+                __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&q->lock);
+
+                if(stop) {
+                        async_drain(q);
+                        return NULL;
+                }
+        }
 }
 
-Error *error_nomem(const char* file, int line, const char *func)
+static Error *start_async(Logger *lg, int drop)
+/* Give `lg` a ring and a writer thread. */
 {
-        nomem_error.meta = (LogMeta){
-                file : file,
-                line : line,
-                func : func,
-        };
-        return &nomem_error;
-}
+        AsyncQueue *q = malloc(sizeof(AsyncQueue));
+        if(!q)
+                return ERROR_NOMEM();
+
+        q->lg = lg;
+        q->drop = drop;
+        q->head = q->tail = q->nflushed = 0;
+        q->ndropped = q->nreported = 0;
+        q->sleeping = q->stop = 0;
+        for(size_t k = 0; k < ELM_ASYNC_NSLOTS; k++)
+                q->slots[k].seq = k;
+
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->wake, NULL);
+        int err = pthread_create(&q->writer, NULL, async_writer, q);
+        if(err) {
+                free(q);
+                return SYS_ERROR(err, "starting writer for log %s", lg->zname);
+        }
 
-static PanicRescue nomem_rescue = no_rescue;
+        lg->async = q;
+        lg->vprintf = async_vprintf;
+        return NULL;
+}
 
-PanicRescue panic_rescue_nomem(PanicRescue new_rescue)
+static void stop_async(AsyncQueue *q)
+/* Drain the ring, then stop the writer thread and free everything. */
 {
-        PanicRescue old = nomem_rescue;
-        if(new_rescue)
-                nomem_rescue = new_rescue;
-        return old;
+        pthread_mutex_lock(&q->lock);
+        q->stop = 1;
+        pthread_cond_signal(&q->wake);
+        pthread_mutex_unlock(&q->lock);
+        pthread_join(q->writer, NULL);
+
+        pthread_cond_destroy(&q->wake);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
 }
 
-void *malloc_or_die(const char* file, int line, const char *func, size_t n)
+static void async_flush(AsyncQueue *q)
+/* Wait until the writer has sent everything queued before the call. */
 {
-        void *ret = malloc(n);
-        if(ret)
-                return ret;
-        if(!nomem_rescue() && (ret = malloc(n)))
-                return ret;
-
-        panic_nomem(file, line, func);
-        return 0;
+        size_t target = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        while(__atomic_load_n(&q->nflushed, __ATOMIC_ACQUIRE) < target) {
+                async_wake(q);
+                sched_yield();
+        }
 }
 
-// -- Panic ----------------------------
 
-static PanicReturn *_panic_return;
+// Rate limited call sites ------.
+/*
+  This is the "generic cell rate algorithm": a bucket holding `per_sec` tokens
+  refills at `per_sec` tokens a second, and rate->tat is the time at which it
+  will be full.  Each message advances tat by one token's worth; and a message
+  which would push tat more than one second past now is suppressed.
 
-Error *_panic_pop(PanicReturn *check)
+  Sites that have ever suppressed a message are listed in rate_sites, so that
+  counts nobody reported yet can be when their logger is flushed or destroyed.
+*/
+
+static pthread_mutex_t rate_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogRate *rate_sites;
+
+static long long mono_ns()
+{
+        struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void list_rate_site(LogRate *rate, const char *file, int line,
+                                           const char *func)
+{
+        pthread_mutex_lock(&rate_sites_lock);
+        if(!rate->listed) {
+                rate->file = file;
+                rate->line = line;
+                rate->func = func;
+                rate->next = rate_sites;
+                __atomic_store_n(&rate_sites, rate, __ATOMIC_RELAXED);
+                __atomic_store_n(&rate->listed, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&rate_sites_lock);
+}
+
+static void report_suppressed(Logger *lg, int forget)
+/* Log the counts still pending at the sites last suppressing for `lg`.  If
+   forget, those sites stop referring to lg (which is being destroyed).
+
+   The counts are taken a few sites at a time under the lock, and logged after
+   releasing it, so that a slow logger does not hold up other threads.  Sites
+   are never removed from the list, so the walk can resume where it stopped. */
+{
+        struct { LogRate *site; unsigned long n; } pending[16];
+        LogRate *r;
+
+        if(!__atomic_load_n(&rate_sites, __ATOMIC_RELAXED))
+                return;
+
+        pthread_mutex_lock(&rate_sites_lock);
+        r = rate_sites;
+        for(;;) {
+                int npending = 0;
+                for(; r && npending < 16; r = r->next) {
+                        if(__atomic_load_n(&r->lg, __ATOMIC_RELAXED) != lg)
+                                continue;
+                        unsigned long n = __atomic_exchange_n(&r->nsuppressed,
+                                                        0, __ATOMIC_RELAXED);
+                        if(forget)
+                                __atomic_store_n(&r->lg, NULL,
+                                                 __ATOMIC_RELAXED);
+                        if(n)
+                                pending[npending].site = r,
+                                pending[npending++].n = n;
+                }
+                pthread_mutex_unlock(&rate_sites_lock);
+
+                for(int k = 0; k < npending; k++) {
+                        LogRate *site = pending[k].site;
+                        log_f(lg, site->file, site->line, site->func,
+                              "%lu messages suppressed", pending[k].n);
+                }
+                if(!r)
+                        return;
+                pthread_mutex_lock(&rate_sites_lock);
+        }
+}
+
+int log_rate_ok(LogRate *rate, Logger *lg, unsigned long per_sec,
+                const char *file, int line, const char *func)
+{
+        assert(per_sec > 0);
+        long long interval = 1000000000LL / per_sec;
+        long long now = mono_ns(), tat, next;
+
+        tat = __atomic_load_n(&rate->tat, __ATOMIC_RELAXED);
+        do {
+                next = (tat > now ? tat : now) + interval;
+                if(next - now > 1000000000LL) {
+                        // A count pending for another logger is dropped.
+                        if(__atomic_exchange_n(&rate->lg, lg,
+                                               __ATOMIC_RELAXED) != lg)
+                                __atomic_store_n(&rate->nsuppressed, 0,
+                                                 __ATOMIC_RELAXED);
+                        __atomic_add_fetch(&rate->nsuppressed, 1,
+                                           __ATOMIC_RELAXED);
+                        if(!__atomic_load_n(&rate->listed, __ATOMIC_ACQUIRE))
+                                list_rate_site(rate, file, line, func);
+                        return 0;
+                }
+        } while(!__atomic_compare_exchange_n(&rate->tat, &tat, next, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        unsigned long n = __atomic_exchange_n(&rate->nsuppressed, 0,
+                                              __ATOMIC_RELAXED);
+        if(n && __atomic_load_n(&rate->lg, __ATOMIC_RELAXED) == lg)
+                log_f(lg, file, line, func, "%lu messages suppressed", n);
+        return 1;
+}
+
+
+// Lazily flushed loggers ------.
+/*
+  Loggers which do not fflush() after every message (asynchronous ones, or
+  ones with a flush policy) are kept on a list so that an uncaught panic can
+  flush them.
+*/
+
+static pthread_mutex_t lazy_loggers_lock = PTHREAD_MUTEX_INITIALIZER;
+static Logger *lazy_loggers;
+
+static int is_lazy(Logger *lg)
+{
+        return lg->async || lg->flush != LOG_FLUSH_ALWAYS;
+}
+
+static void link_lazy(Logger *lg)
+{
+        pthread_mutex_lock(&lazy_loggers_lock);
+        lg->next_lazy = lazy_loggers;
+        lazy_loggers = lg;
+        pthread_mutex_unlock(&lazy_loggers_lock);
+}
+
+static void unlink_lazy(Logger *lg)
+{
+        pthread_mutex_lock(&lazy_loggers_lock);
+        for(Logger **plg = &lazy_loggers; *plg; plg = &(*plg)->next_lazy)
+                if(*plg == lg) {
+                        *plg = lg->next_lazy;
+                        break;
+                }
+        pthread_mutex_unlock(&lazy_loggers_lock);
+}
+
+static int rotator_fflush(Logger *lg);
+
+static int flush_stream(Logger *lg)
+/* Like fflush(), but first waits for any writer thread. */
+{
+        if(lg->async)
+                async_flush(lg->async);
+        __atomic_store_n(&lg->npending, 0, __ATOMIC_RELAXED);
+        lg->flushed_at = now_ms();
+        return lg->map ? 0 :  // the page cache has it
+               lg->rot ? rotator_fflush(lg) : fflush(lg->stream);
+}
+
+static void flush_lazy_loggers()
+/* Called by death_panic(), so that no pending message dies with the process.
+   (Caught panics don't flush: they must stay cheap and never wait.) */
+{
+        if(!__atomic_load_n(&lazy_loggers, __ATOMIC_RELAXED))
+                return;
+
+        pthread_mutex_lock(&lazy_loggers_lock);
+        for(Logger *lg = lazy_loggers; lg; lg = lg->next_lazy)
+                if(!is_null_logger(lg) && flush_stream(lg) == EOF)
+                        emergency_message("LOGFAILED", NULL, lg->zname);
+        pthread_mutex_unlock(&lazy_loggers_lock);
+}
+
+void logger_flush_policy(Logger *lg, LogFlush policy, unsigned long n)
+{
+        init_static_logger(lg);
+        int was_lazy = is_lazy(lg);
+
+        lg->flush = policy;
+        lg->flush_n = n;
+        lg->npending = 0;
+        lg->flushed_at = now_ms();
+
+        if(is_lazy(lg) && !was_lazy)
+                link_lazy(lg);
+        else if(!is_lazy(lg) && was_lazy)
+                unlink_lazy(lg);
+}
+
+
+// Binary loggers ------.
+/*
+  A binary logger defers all formatting: each message is recorded as the raw
+  values of its arguments, and `log_decode` later turns them into text.  The
+  log is written in native byte order and type sizes, so it must be decoded on
+  the same kind of machine.  It consists of
+
+        header:  "ELM0BIN\n", u8 version, u8 flags, u16 n, char zname[n]
+        site:    'S', u32 id, i32 line, u8 eager, str fmt, str file, str func
+        message: 'M', u32 id, i64 time (ns), [i64 tid,] u32 n, char args[n]
+
+  where "str" is a u32 length followed by that many bytes, and the tid is
+  there only if the header's flags include BIN_TID.  A site record appears
+  once per call site, the first time that site logs.  The args of a message
+  are the values consumed by each conversion in the site's format, in order,
+  with strings stored as "str" (length BIN_NULL for a NULL pointer).
+  Formats with conversions that can not be deferred (e.g. %n, %m or
+  positional arguments) mark their site as "eager": the message is formatted
+  on the spot and stored as a single "str".
+*/
+
+#define BIN_MAGIC "ELM0BIN\n"
+#define BIN_VERSION 2
+#define BIN_DBG  1      // header flag: the logger was made with 'd'
+#define BIN_TIME 2      // ... with 'T'
+#define BIN_TID  4      // ... with 'i', so messages record the tid
+#define BIN_NULL ((uint32_t)-1)
+
+typedef struct {
+        const char *fmt, *file, *func;
+        int line;
+        uint32_t id;
+} BinSite;
+
+struct BinLog {
+        BinSite *sites;         // open addressed hash table
+        size_t nsites, cap;     // cap is zero or a power of two
+};
+
+typedef struct {
+        char  *p;
+        size_t n, cap;
+        char   small[512];
+} ByteBuf;
+
+static void bb_init(ByteBuf *bb)
+{
+        bb->p = bb->small;
+        bb->n = 0;
+        bb->cap = sizeof bb->small;
+}
+
+static void bb_free(ByteBuf *bb)
+{
+        if(bb->p != bb->small)
+                free(bb->p);
+}
+
+static void bb_reserve(ByteBuf *bb, size_t n)
+{
+        if(bb->n + n <= bb->cap)
+                return;
+
+        size_t cap = 2 * (bb->n + n);
+        char *p = MALLOC(cap);
+        memcpy(p, bb->p, bb->n);
+        bb_free(bb);
+        bb->p = p;
+        bb->cap = cap;
+}
+
+static void bb_put(ByteBuf *bb, const void *data, size_t n)
+{
+        bb_reserve(bb, n);
+        memcpy(bb->p + bb->n, data, n);
+        bb->n += n;
+}
+
+static void bb_printf(ByteBuf *bb, const char *fmt, ...)
+{
+        va_list va;
+        va_start(va, fmt);
+        int n = vsnprintf(NULL, 0, fmt, va);
+        va_end(va);
+        if(n < 0)
+                return;
+
+        bb_reserve(bb, n + 1);
+        va_start(va, fmt);
+        vsnprintf(bb->p + bb->n, n + 1, fmt, va);
+        va_end(va);
+        bb->n += n;
+}
+
+typedef struct {
+        const char *end;        // just past the conversion
+        char type;              // see parse_conversion
+        char star_width, star_prec;
+        int  prec;              // literal precision, or -1
+} Conversion;
+
+static int parse_conversion(const char *p, Conversion *cv)
+/* Parses the printf conversion that starts with the '%' at p.  On success,
+   cv->type is one of
+        i (int), l (long), q (long long), j (intmax_t), z (size_t),
+        t (ptrdiff_t), d (double), D (long double), s (string), p (pointer),
+   or 0 for "%%".  Returns 0 for anything else (%n, %m, %1$d, %ls ...). */
+{
+        int len = 0, ch;
+
+        *cv = (Conversion){ .prec = -1 };
+        if(*++p == '%') {
+                cv->end = p + 1;
+                return 1;
+        }
+
+        while(*p && strchr("-+ #0'", *p))
+                p++;
+        if(*p == '*') {
+                cv->star_width = 1;
+                p++;
+        } else while(*p >= '0' && *p <= '9')
+                p++;
+
+        if(*p == '.') {
+                if(*++p == '*') {
+                        cv->star_prec = 1;
+                        p++;
+                } else for(cv->prec = 0; *p >= '0' && *p <= '9'; p++)
+                        cv->prec = 10 * cv->prec + *p - '0';
+        }
+
+        switch(*p) {
+        case 'h': len = 'h'; p += 1 + (p[1] == 'h'); break;
+        case 'l': len = p[1] == 'l' ? 'q' : 'l'; p += 1 + (p[1] == 'l'); break;
+        case 'q': case 'j': case 'z': case 't': case 'L': len = *p++; break;
+        }
+
+        cv->end = p + 1;
+        switch(ch = *p) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                if(len == 'L')
+                        return 0;
+                cv->type = (!len || len == 'h') ? 'i' : len;
+                return 1;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+                if(len && len != 'l' && len != 'L')
+                        return 0;
+                cv->type = len == 'L' ? 'D' : 'd';
+                return 1;
+        case 'c': case 's': case 'p':
+                cv->type = ch == 'c' ? 'i' : ch;
+                return !len;
+        }
+        return 0;
+}
+
+static int bin_encode_args(ByteBuf *bb, const char *fmt, va_list va)
+/* Append the values of the arguments; returns 0 if they can't be deferred. */
+{
+        Conversion cv;
+        for(const char *p = fmt; p = strchr(p, '%'); p = cv.end) {
+                if(!parse_conversion(p, &cv))
+                        return 0;
+
+                int prec = cv.prec;
+                if(cv.star_width) {
+                        int width = va_arg(va, int);
+                        bb_put(bb, &width, sizeof width);
+                }
+                if(cv.star_prec) {
+                        prec = va_arg(va, int);
+                        bb_put(bb, &prec, sizeof prec);
+                }
+
+#define BIN_PUT(T) { T v = va_arg(va, T); bb_put(bb, &v, sizeof v); break; }
+                switch(cv.type) {
+                case 'i': BIN_PUT(int)
+                case 'l': BIN_PUT(long)
+                case 'q': BIN_PUT(long long)
+                case 'j': BIN_PUT(intmax_t)
+                case 'z': BIN_PUT(size_t)
+                case 't': BIN_PUT(ptrdiff_t)
+                case 'd': BIN_PUT(double)
+                case 'D': BIN_PUT(long double)
+                case 'p': BIN_PUT(void*)
+                case 's': {
+                        const char *z = va_arg(va, const char*);
+                        uint32_t n = !z ? BIN_NULL :
+                                     prec >= 0 ? strnlen(z, prec) : strlen(z);
+                        bb_put(bb, &n, sizeof n);
+                        if(z)
+                                bb_put(bb, z, n);
+                }}
+#undef BIN_PUT
+        }
+        return 1;
+}
+
+
+static void bin_put_str(ByteBuf *bb, const char *z)
+{
+        uint32_t n = strlen(z);
+        bb_put(bb, &n, sizeof n);
+        bb_put(bb, z, n);
+}
+
+static size_t bin_hash(const char *fmt, LogMeta *meta)
+{
+        size_t h = (uintptr_t)fmt ^ 31 * (uintptr_t)meta->file;
+        h ^= 17 * (uintptr_t)meta->func + meta->line;
+        return h ^ (h >> 7) ^ (h >> 17);
+}
+
+static BinSite *bin_site(BinLog *bl, const char *fmt, LogMeta *meta)
+/* Find the site for fmt & meta; an empty slot (fmt == NULL) if it's new. */
+{
+        size_t mask = bl->cap - 1;
+        for(size_t k = bin_hash(fmt, meta);; k++) {
+                BinSite *s = bl->sites + (k & mask);
+                if(!s->fmt || s->fmt == fmt && s->line == meta->line &&
+                              s->file == meta->file && s->func == meta->func)
+                        return s;
+        }
+}
+
+static int bin_grow(BinLog *bl)
+/* Double the site table.  Returns 0 if out of memory. */
+{
+        BinLog old = *bl;
+        size_t cap = old.cap ? 2 * old.cap : 64;
+        BinSite *sites = calloc(cap, sizeof(BinSite));
+        if(!sites)
+                return 0;
+
+        bl->sites = sites;
+        bl->cap = cap;
+        for(size_t k = 0; k < old.cap; k++) {
+                BinSite *s = old.sites + k;
+                if(s->fmt)
+                        *bin_site(bl, s->fmt, &(LogMeta){
+                                .file = s->file,
+                                .func = s->func,
+                                .line = s->line }) = *s;
+        }
+        free(old.sites);
+        return 1;
+}
+
+static void bin_write_str(FILE *out, const char *z)
+{
+        uint32_t n = strlen(z);
+        fwrite(&n, sizeof n, 1, out);
+        fwrite(z, 1, n, out);
+}
+
+static void bin_write_site(FILE *out, BinSite *s, uint8_t eager)
+{
+        putc('S', out);
+        fwrite(&s->id, sizeof s->id, 1, out);
+        fwrite(&s->line, sizeof s->line, 1, out);
+        fwrite(&eager, 1, 1, out);
+        bin_write_str(out, s->fmt);
+        bin_write_str(out, s->file);
+        bin_write_str(out, s->func);
+}
+
+static int binary_vprintf(Logger *lg, LogMeta *meta, const char *msg, va_list va)
+/* method: record the message's arguments, for log_decode to format later. */
+{
+        int with_tid = lg->stamp & LOG_STAMP_TID;
+        const size_t nhead = with_tid ? 25 : 17; // 'M', id, time, [tid,] n
+        BinLog *bl = lg->binary;
+        ByteBuf bb;
+        va_list va2;
+
+        // the same stamps a text logger would print
+        int64_t ns = meta->time_ns ? meta->time_ns : clock_ns();
+        int64_t tid = meta->tid ? meta->tid : thread_id();
+
+        bb_init(&bb);
+        bb.n = nhead;
+
+        va_copy(va2, va);
+        int eager = !bin_encode_args(&bb, msg, va2);
+        va_end(va2);
+        if(eager) {
+                char *text = NULL;
+                if(vasprintf(&text, msg, va) < 0) {
+                        bb_free(&bb);
+                        panic_nomem(meta->file, meta->line, meta->func);
+                }
+                bb.n = nhead;
+                bin_put_str(&bb, text);
+                free(text);
+        }
+
+        uint32_t nargs = bb.n - nhead;
+        bb.p[0] = 'M';
+        memcpy(bb.p + 5, &ns, 8);
+        if(with_tid)
+                memcpy(bb.p + 13, &tid, 8);
+        memcpy(bb.p + nhead - 4, &nargs, 4);
+
+        // The site table is guarded by the stream's lock, this way each site
+        // record precedes the first message from that site.
+        flockfile(lg->stream);
+        BinSite *s = bin_site(bl, msg, meta);
+        if(!s->fmt) {
+                if(2 * (bl->nsites + 1) > bl->cap) {
+                        if(!bin_grow(bl)) {
+                                funlockfile(lg->stream);
+                                bb_free(&bb);
+                                panic_nomem(meta->file, meta->line, meta->func);
+                        }
+                        s = bin_site(bl, msg, meta);
+                }
+                *s = (BinSite){
+                        .fmt  = msg,
+                        .file = meta->file,
+                        .func = meta->func,
+                        .line = meta->line,
+                        .id   = bl->nsites++,
+                };
+                bin_write_site(lg->stream, s, eager);
+        }
+        memcpy(bb.p + 1, &s->id, 4);
+
+        int n = fwrite(bb.p, 1, bb.n, lg->stream);
+        int ok = n == bb.n &&
+                 (!flush_due(lg, n, 0) || fflush(lg->stream) != EOF);
+        funlockfile(lg->stream);
+        bb_free(&bb);
+
+        if(!ok) {
+                emergency_message("LOGFAILED", meta, msg);
+                return -1;
+        }
+        return n;
+}
+
+static Error *start_binary(Logger *lg)
+/* Give `lg` a site table, and write the log header. */
+{
+        BinLog *bl = malloc(sizeof(BinLog));
+        if(!bl || (*bl = (BinLog){0}, !bin_grow(bl))) {
+                free(bl);
+                return ERROR_NOMEM();
+        }
+
+        size_t nzname = strlen(lg->zname);
+        uint16_t nz16 = nzname < UINT16_MAX ? nzname : UINT16_MAX;
+        uint8_t head[] = {
+                BIN_VERSION,
+                (lg->sprint_prefix == dbg_prefix ? BIN_DBG : 0) |
+                (lg->stamp & LOG_STAMP_TIME ? BIN_TIME : 0) |
+                (lg->stamp & LOG_STAMP_TID ? BIN_TID : 0)
+        };
+
+        fwrite(BIN_MAGIC, 1, 8, lg->stream);
+        fwrite(head, 1, sizeof head, lg->stream);
+        fwrite(&nz16, sizeof nz16, 1, lg->stream);
+        fwrite(lg->zname, 1, nz16, lg->stream);
+        if(fflush(lg->stream) == EOF) {
+                free(bl->sites);
+                free(bl);
+                return SYS_ERROR(errno, "writing binary log %s", lg->zname);
+        }
+
+        lg->binary = bl;
+        lg->vprintf = binary_vprintf;
+        return NULL;
+}
+
+static void stop_binary(BinLog *bl)
+{
+        free(bl->sites);
+        free(bl);
+}
+
+// -- decoding
+
+typedef struct {
+        char *fmt, *file, *func;
+        int line, eager;
+} DecSite;
+
+static int read_all(FILE *in, void *p, size_t n)
+{
+        return fread(p, 1, n, in) == n;
+}
+
+static char *read_str(FILE *in)
+/* Read a "str" into a free()able buffer; NULL if the input is truncated. */
+{
+        uint32_t n;
+        if(!read_all(in, &n, sizeof n))
+                return NULL;
+
+        char *z = MALLOC(n + 1ULL);
+        if(!read_all(in, z, n)) {
+                free(z);
+                return NULL;
+        }
+        z[n] = 0;
+        return z;
+}
+
+static int bin_render(ByteBuf *out, const char *fmt, const char *arg,
+                                                     const char *end)
+/* Format `fmt` using raw argument values from [arg, end), as recorded by
+   bin_encode_args.  Returns 0 if the values don't match the format. */
+{
+        Conversion cv;
+        const char *p = fmt;
+
+#define BIN_GET(v) do {                                         \
+                if(end - arg < (ptrdiff_t)sizeof (v))           \
+                        return 0;                               \
+                memcpy(&(v), arg, sizeof (v));                  \
+                arg += sizeof (v);                              \
+        } while(0)
+
+        for(const char *q; q = strchr(p, '%'); p = cv.end) {
+                bb_put(out, p, q - p);
+                if(!parse_conversion(q, &cv))
+                        return 0;
+                if(!cv.type) {
+                        bb_put(out, "%", 1);
+                        continue;
+                }
+
+                // rebuild the conversion, with literal numbers for the '*'s
+                char spec[80];
+                size_t n = 0;
+                if(cv.end - q > 48)
+                        return 0;
+                for(const char *c = q; c < cv.end; c++) {
+                        int star;
+                        if(*c != '*') {
+                                spec[n++] = *c;
+                                continue;
+                        }
+                        BIN_GET(star);
+                        if(star < 0 && c[-1] == '.')
+                                n--; // negative precisions are ignored
+                        else
+                                n += sprintf(spec + n, "%d", star);
+                }
+                spec[n] = 0;
+
+#define BIN_FMT(T) { T v; BIN_GET(v); bb_printf(out, spec, v); break; }
+                switch(cv.type) {
+                case 'i': BIN_FMT(int)
+                case 'l': BIN_FMT(long)
+                case 'q': BIN_FMT(long long)
+                case 'j': BIN_FMT(intmax_t)
+                case 'z': BIN_FMT(size_t)
+                case 't': BIN_FMT(ptrdiff_t)
+                case 'd': BIN_FMT(double)
+                case 'D': BIN_FMT(long double)
+                case 'p': BIN_FMT(void*)
+                case 's': {
+                        uint32_t len;
+                        BIN_GET(len);
+                        if(len == BIN_NULL) {
+                                bb_printf(out, spec, (char*)NULL);
+                                break;
+                        }
+                        if(end - arg < len)
+                                return 0;
+                        char *z = MALLOC(len + 1ULL);
+                        memcpy(z, arg, len);
+                        z[len] = 0;
+                        arg += len;
+                        bb_printf(out, spec, z);
+                        free(z);
+                }}
+#undef BIN_FMT
+        }
+#undef BIN_GET
+
+        bb_put(out, p, strlen(p));
+        return arg == end;
+}
+
+Error *log_decode(FILE *in, FILE *out, const char *opts)
+/* Turn a binary log back into the text its logger would have written. */
+{
+        char magic[8];
+        uint8_t head[2];
+        uint16_t nzname;
+        int times = opts && strchr(opts, 't');
+
+        if(!read_all(in, magic, sizeof magic) ||
+           memcmp(magic, BIN_MAGIC, sizeof magic) ||
+           !read_all(in, head, sizeof head) || head[0] != BIN_VERSION ||
+           !read_all(in, &nzname, sizeof nzname))
+                return ERROR("Not an elm binary log.");
+
+        char zname[nzname + 1];
+        if(!read_all(in, zname, nzname))
+                return ERROR("Truncated binary log.");
+        zname[nzname] = 0;
+
+        char zopts[16], *o = zopts;
+        if(head[1] & BIN_DBG)
+                *o++ = 'd';
+        if(head[1] & BIN_TIME)
+                *o++ = 'T';
+        if(head[1] & BIN_TID)
+                *o++ = 'i';
+        strcpy(o, "b65536");
+
+        Logger *lg = new_logger(zname, out, zopts);
+        DecSite *sites = NULL;
+        uint32_t nsites = 0;
+        ByteBuf args, body;
+        Error *err = NULL;
+        int ch;
+
+        bb_init(&args);
+        bb_init(&body);
+        while(!err && (ch = getc(in)) != EOF) switch(ch) {
+        case 'S': {
+                uint32_t id;
+                int32_t line;
+                uint8_t eager;
+                if(!read_all(in, &id, sizeof id) ||
+                   !read_all(in, &line, sizeof line) ||
+                   !read_all(in, &eager, sizeof eager))
+                        goto truncated;
+                if(id != nsites) {
+                        err = ERROR("Bad site %u in binary log.", id);
+                        break;
+                }
+
+                if(!(nsites & (nsites + 1))) {
+                        DecSite *more = MALLOC(2 * (nsites + 1) * sizeof *more);
+                        memcpy(more, sites, nsites * sizeof *more);
+                        free(sites);
+                        sites = more;
+                }
+                DecSite *s = sites + nsites++;
+                *s = (DecSite){ .line = line, .eager = eager };
+                if(!(s->fmt  = read_str(in)) ||
+                   !(s->file = read_str(in)) ||
+                   !(s->func = read_str(in)))
+                        goto truncated;
+                break;
+        }
+        case 'M': {
+                uint32_t id, n;
+                int64_t ns, tid = 0;
+                if(!read_all(in, &id, sizeof id) ||
+                   !read_all(in, &ns, sizeof ns) ||
+                   head[1] & BIN_TID && !read_all(in, &tid, sizeof tid) ||
+                   !read_all(in, &n, sizeof n))
+                        goto truncated;
+                if(id >= nsites) {
+                        err = ERROR("Bad site %u in binary log.", id);
+                        break;
+                }
+
+                args.n = 0;
+                bb_reserve(&args, n);
+                if(!read_all(in, args.p, n))
+                        goto truncated;
+
+                DecSite *s = sites + id;
+                body.n = 0;
+                if(!bin_render(&body, s->eager ? "%s" : s->fmt,
+                               args.p, args.p + n)) {
+                        err = ERROR("Bad message from %s:%d in binary log.",
+                                    s->file, s->line);
+                        break;
+                }
+                bb_put(&body, "", 1);
+
+                if(times)
+                        fprintf(out, "[%lld.%06lld] ",
+                                (long long)(ns / 1000000000),
+                                (long long)(ns % 1000000000 / 1000));
+
+                LogMeta meta = {
+                        .file = s->file,
+                        .func = s->func,
+                        .line = s->line,
+                        .tid = tid,
+                        .time_ns = ns,
+                };
+                if(meta_printf(lg, &meta, "%s", body.p) < 0)
+                        err = SYS_ERROR(errno, "writing decoded log");
+                break;
+        }
+        default:
+                err = ERROR("Bad record type %d in binary log.", ch);
+                break;
+        truncated:
+                err = ERROR("Truncated binary log.");
+                break;
+        }
+
+        if(!err && ferror(in))
+                err = SYS_ERROR(errno, "reading binary log");
+
+        for(uint32_t k = 0; k < nsites; k++) {
+                free(sites[k].fmt);
+                free(sites[k].file);
+                free(sites[k].func);
+        }
+        free(sites);
+        bb_free(&args);
+        bb_free(&body);
+        return keep_first_error(err, destroy_logger(lg));
+}
+
+
+// Lazy errors ------.
+/*
+  These reuse the binary logger's argument encoding.  A lazy error's data is a
+  LazyMsg, stored inside the error if it fits.
+*/
+
+typedef struct {
+        const char *fmt;        // NULL if the message was formatted eagerly,
+        size_t n;
+        char args[];            // in which case this is its text.
+} LazyMsg;
+
+static int lazy_error_fwrite(Error *e, FILE *out)
+{
+        LazyMsg *lm = e->data;
+        if(!lm->fmt)
+                return fwrite(lm->args, 1, lm->n, out);
+
+        ByteBuf bb;
+        bb_init(&bb);
+        int n = !bin_render(&bb, lm->fmt, lm->args, lm->args + lm->n) ? -1 :
+                fwrite(bb.p, 1, bb.n, out);
+        bb_free(&bb);
+        return n;
+}
+
+static const ErrorType _lazy_error_type = {
+        fwrite    : lazy_error_fwrite,
+};
+
+const ErrorType *const lazy_error_type = &_lazy_error_type;
+
+Error *init_lazy_error(Error *e, const char *zfmt, ...)
+{
+        int errnum = errno; // for %m
+        LazyMsg lm = { .fmt = zfmt };
+        ByteBuf bb;
+        va_list va;
+
+        bb_init(&bb);
+        bb_put(&bb, &lm, sizeof lm);
+        va_start(va, zfmt);
+        int deferred = bin_encode_args(&bb, zfmt, va);
+        va_end(va);
+
+        if(!deferred) {
+                lm.fmt = NULL;
+                bb.n = sizeof lm;
+
+                va_start(va, zfmt);
+                int n = vsnprintf(NULL, 0, zfmt, va);
+                va_end(va);
+                if(n < 0)
+                        n = 0;
+
+                bb_reserve(&bb, n + 1);
+                errno = errnum;
+                va_start(va, zfmt);
+                vsnprintf(bb.p + bb.n, n + 1, zfmt, va);
+                va_end(va);
+                bb.n += n;
+        }
+
+        lm.n = bb.n - sizeof lm;
+        memcpy(bb.p, &lm, sizeof lm);
+
+        char *zinline = ((ErrorBlock*)e)->zmsg;
+        if(bb.n <= sizeof ((ErrorBlock*)e)->zmsg) {
+                memcpy(zinline, bb.p, bb.n);
+                e->data = zinline;
+                bb_free(&bb);
+        } else if(bb.p == bb.small) {
+                e->data = MALLOC(bb.n);
+                memcpy(e->data, bb.p, bb.n);
+        } else {
+                e->data = bb.p; // keep the heap buffer
+        }
+        return e;
+}
+
+
+// Memory mapped loggers ------.
+/*
+  The log file is mapped in segments of (at least) seg_size bytes.  Writers
+  claim space by atomically advancing `used`, and copy their text in while
+  holding `lock` for reading.  The writer whose claim first runs past the end
+  records where the text ends, and then (holding the lock for writing) the
+  segment is truncated to that length and renamed to "<path>.<k>" for the
+  first free k, and a new segment is mapped.
+*/
+
+struct MapLog {
+        pthread_rwlock_t lock;
+        char  *path;
+        int    fd;
+        char  *base;
+        size_t size, seg_size;
+        size_t used;     // bytes claimed, can run past size
+        size_t end;      // the length of the text, once used > size
+        unsigned nseg;   // counts segments, so writers can see a roll
+        unsigned next_k; // the first <path>.k that might be free
+};
+
+static Error *map_segment(MapLog *m, size_t min_size)
+/* Open & map m->path, keeping any text it already has. */
+{
+        struct stat st;
+        int fd = open(m->path, O_RDWR | O_CREAT, 0666);
+        if(fd < 0)
+                return IO_ERROR(m->path, errno, "opening log");
+        if(fstat(fd, &st) < 0)
+                goto fail;
+
+        size_t used = st.st_size;
+        size_t size = used + (min_size > m->seg_size ? min_size : m->seg_size);
+        if(ftruncate(fd, size) < 0)
+                goto fail;
+
+        char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+        if(base == MAP_FAILED) {
+                int errnum = errno; // report this, but first
+                while(ftruncate(fd, used) < 0 && errno == EINTR)
+                        ; // don't leave the file padded with NULs
+                errno = errnum;
+                goto fail;
+        }
+
+        while(used && !base[used - 1]) // left by a crash
+                used--;
+
+        m->fd = fd;
+        m->base = base;
+        m->size = size;
+        m->used = used;
+        m->end = size;
+        m->nseg++;
+        return NULL;
+
+fail: {
+        Error *err = IO_ERROR(m->path, errno, "mapping log");
+        close(fd);
+        return err;
+}}
+
+static Error *unmap_segment(MapLog *m)
+/* Truncate the segment to its text, and unmap it. */
+{
+        size_t len = m->used <= m->size ? m->used : m->end;
+        munmap(m->base, m->size);
+        int ok = ftruncate(m->fd, len) == 0;
+        ok = close(m->fd) == 0 && ok;
+        return ok ? NULL : IO_ERROR(m->path, errno, "closing log");
+}
+
+static Error *roll_map(MapLog *m, size_t min_size)
+/* Start a new segment; called with the lock held for writing. */
+{
+        Error *err = unmap_segment(m);
+        if(err)
+                return err;
+
+        // Only the first roll has to search far: later ones start from there.
+        size_t nz = strlen(m->path) + 24;
+        char zold[nz];
+        struct stat st;
+        unsigned k = m->next_k;
+        for(;; k++) {
+                snprintf(zold, nz, "%s.%u", m->path, k);
+                if(stat(zold, &st) < 0 && errno == ENOENT)
+                        break;
+        }
+        if(rename(m->path, zold) < 0)
+                return IO_ERROR(zold, errno, "rolling log");
+        m->next_k = k + 1;
+        return map_segment(m, min_size);
+}
+
+static int map_write(MapLog *m, const char *text, size_t n)
+{
+        pthread_rwlock_rdlock(&m->lock);
+        for(;;) {
+                if(!m->base) { // a roll failed
+                        pthread_rwlock_unlock(&m->lock);
+                        return -1;
+                }
+
+                size_t off = __atomic_fetch_add(&m->used, n, __ATOMIC_RELAXED);
+                if(off + n <= m->size) {
+                        memcpy(m->base + off, text, n);
+                        pthread_rwlock_unlock(&m->lock);
+                        return n;
+                }
+                if(off < m->size)
+                        m->end = off; // only one writer gets here
+
+                unsigned nseg = m->nseg;
+                pthread_rwlock_unlock(&m->lock);
+
+                pthread_rwlock_wrlock(&m->lock);
+                Error *err = nseg != m->nseg ? NULL : roll_map(m, n);
+                if(err) {
+                        m->base = NULL; // we can't log, so don't try again
+                        pthread_rwlock_unlock(&m->lock);
+                        log_error(err_log, err);
+                        destroy_error(err);
+                        return -1;
+                }
+        }
+}
+
+static int map_vprintf(Logger *lg, LogMeta *meta, const char *msg, va_list va)
+/* method: format a message on the stack, then copy it into the map. */
+{
+        char small[ELM_LOG_LINE_STACK];
+        size_t n;
+
+        char *line = format_line(lg, meta, msg, va, small, sizeof small, &n);
+        if(!line) {
+                emergency_message("LOGFAILED", meta, msg);
+                return -1;
+        }
+
+        int nw = map_write(lg->map, line, n);
+        if(line != small)
+                free(line);
+        return nw;
+}
+
+static Error *start_map(Logger *lg, const char *path, size_t seg_size)
+{
+        MapLog *m = MALLOC(sizeof(MapLog));
+        *m = (MapLog){ .path = strdup(path), .seg_size = seg_size,
+                       .next_k = 1 };
+        if(!m->path) {
+                free(m);
+                return ERROR_NOMEM();
+        }
+
+        Error *err = map_segment(m, 0);
+        if(err) {
+                free(m->path);
+                free(m);
+                return err;
+        }
+
+        pthread_rwlock_init(&m->lock, NULL);
+        lg->map = m;
+        lg->vprintf = map_vprintf;
+        lg->gate.threshold = LOG_LEVEL_DEBUG;
+        return NULL;
+}
+
+static void stop_map(MapLog *m)
+{
+        if(m->base) {
+                Error *err = unmap_segment(m);
+                if(err) {
+                        log_error(err_log, err);
+                        destroy_error(err);
+                }
+        }
+        pthread_rwlock_destroy(&m->lock);
+        free(m->path);
+        free(m);
+}
+
+
+// Rotating loggers ------.
+/*
+  Writers hold `swap` for reading while they write a message.  The writer that
+  finds the rotation due opens the new file without any lock, and only holds
+  `swap` for writing while it changes lg->stream.  Closed files are gzipped by
+  a background thread, if `compress` is set.
+*/
+
+typedef struct ZName ZName;
+struct ZName {
+        ZName *next;
+        char   name[];
+};
+
+struct Rotator {
+        pthread_rwlock_t swap;   // guards lg->stream
+        pthread_mutex_t  lock;   // held while rotating, guards `name`
+        char *pattern, *name;    // the strftime() pattern and current file
+
+        unsigned long max_bytes;    // rotate once this many were written,
+        unsigned long interval_ms;  // or this long after the last rotation
+        unsigned long nbytes;
+        long long deadline;
+
+        int compress;
+        pthread_mutex_t zlock;   // guards the fields below
+        pthread_cond_t  zwake;
+        pthread_t zthread;
+        int zstarted, zstop;
+        ZName *znames;           // waiting to be compressed
+};
+
+static int name_taken(char *z, size_t len)
+/* Does a file z, or its compressed z.gz, exist?  z must have room for ".gz". */
+{
+        struct stat st;
+        if(stat(z, &st) == 0)
+                return 1;
+        strcpy(z + len, ".gz");
+        int taken = stat(z, &st) == 0;
+        z[len] = 0;
+        return taken;
+}
+
+static char *rotation_name(const char *pattern, int unique)
+/* Expand `pattern` with the current UTC time.  If unique, append ".<k>" for
+   the first k that names neither a file nor a compressed one, so that a
+   name once used (and then gzipped away) is never used again. */
+{
+        time_t t = time(NULL);
+        struct tm tm;
+        gmtime_r(&t, &tm);
+
+        size_t nz = strlen(pattern) + 256;
+        char *z = MALLOC(nz);
+        size_t len = strftime(z, nz - 24, pattern, &tm);
+        if(!len)
+                len = snprintf(z, nz - 24, "%s", pattern);
+
+        size_t nbase = len;
+        for(unsigned k = 1; unique && name_taken(z, len); k++)
+                len = nbase + snprintf(z + nbase, 20, ".%u", k);
+        return z;
+}
+
+static void gzip_file(const char *name)
+{
+        // no -f: never clobber an existing .gz
+        char *argv[] = { "gzip", "--", (char*)name, NULL };
+        int status, err;
+        pid_t pid;
+
+        err = posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ);
+        if(!err && waitpid(pid, &status, 0) < 0)
+                err = errno;
+        if(!err && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+                err = ECHILD;
+        if(err) {
+                Error *e = IO_ERROR(name, err, "compressing rotated log");
+                log_error(err_log, e);
+                destroy_error(e);
+        }
+}
+
+static void *compress_thread(void *arg)
+{
+        Rotator *r = arg;
+        pthread_mutex_lock(&r->zlock);
+        for(;;) {
+                while(!r->znames && !r->zstop)
+                        pthread_cond_wait(&r->zwake, &r->zlock);
+                ZName *zn = r->znames;
+                if(!zn)
+                        break;
+                r->znames = zn->next;
+
+                pthread_mutex_unlock(&r->zlock);
+                gzip_file(zn->name);
+                free(zn);
+                pthread_mutex_lock(&r->zlock);
+        }
+        pthread_mutex_unlock(&r->zlock);
+        return NULL;
+}
+
+static void compress_later(Rotator *r, const char *name)
+{
+        size_t nname = strlen(name) + 1;
+        ZName *zn = MALLOC(sizeof(ZName) + nname);
+        memcpy(zn->name, name, nname);
+
+        pthread_mutex_lock(&r->zlock);
+        zn->next = r->znames;
+        r->znames = zn;
+        if(!r->zstarted)
+                r->zstarted = !pthread_create(&r->zthread, NULL,
+                                              compress_thread, r);
+        pthread_cond_signal(&r->zwake);
+        pthread_mutex_unlock(&r->zlock);
+}
+
+static int rotation_due(Rotator *r)
+{
+        return r->max_bytes &&
+               __atomic_load_n(&r->nbytes, __ATOMIC_RELAXED) >= r->max_bytes ||
+               r->interval_ms &&
+               now_ms() >= __atomic_load_n(&r->deadline, __ATOMIC_RELAXED);
+}
+
+static void rotate(Logger *lg)
+{
+        Rotator *r = lg->rot;
+        if(pthread_mutex_trylock(&r->lock))
+                return; // someone else is doing it
+        if(!rotation_due(r))
+                goto done;
+
+        __atomic_store_n(&r->nbytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->deadline, now_ms() + r->interval_ms,
+                         __ATOMIC_RELAXED);
+
+        char *name = rotation_name(r->pattern, 1);
+        FILE *f = fopen(name, "a");
+        if(!f) {
+                Error *err = IO_ERROR(name, errno, "rotating log");
+                free(name);
+                log_error(err_log, err);
+                destroy_error(err);
+                goto done;
+        }
+
+        pthread_rwlock_wrlock(&r->swap);
+        FILE *old = lg->stream;
+        lg->stream = f;
+        pthread_rwlock_unlock(&r->swap);
+
+        fclose(old);
+        if(r->compress)
+                compress_later(r, r->name);
+        free(r->name);
+        r->name = name;
+done:
+        pthread_mutex_unlock(&r->lock);
+}
+
+static int rotator_vprintf(Logger *lg, LogMeta *meta, const char *msg,
+                                                      va_list va)
+/* method: log_vprintf, then rotate the file if it is time. */
+{
+        Rotator *r = lg->rot;
+        pthread_rwlock_rdlock(&r->swap);
+        int n = log_vprintf(lg, meta, msg, va);
+        pthread_rwlock_unlock(&r->swap);
+
+        if(n > 0)
+                __atomic_add_fetch(&r->nbytes, n, __ATOMIC_RELAXED);
+        if(rotation_due(r))
+                rotate(lg);
+        return n;
+}
+
+static int rotator_fflush(Logger *lg)
+{
+        pthread_rwlock_rdlock(&lg->rot->swap);
+        int ret = fflush(lg->stream);
+        pthread_rwlock_unlock(&lg->rot->swap);
+        return ret;
+}
+
+static void start_rotator(Logger *lg, const char *pattern, char *name,
+                          unsigned long max_bytes, unsigned long interval_ms,
+                          int compress)
+{
+        Rotator *r = MALLOC(sizeof(Rotator));
+        struct stat st;
+
+        *r = (Rotator){
+                .pattern = strdup(pattern),
+                .name = name,
+                .max_bytes = max_bytes,
+                .interval_ms = interval_ms,
+                .nbytes = fstat(fileno(lg->stream), &st) ? 0 : st.st_size,
+                .deadline = now_ms() + interval_ms,
+                .compress = compress,
+        };
+        if(!r->pattern) {
+                free(r);
+                PANIC_NOMEM();
+        }
+        pthread_rwlock_init(&r->swap, NULL);
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_mutex_init(&r->zlock, NULL);
+        pthread_cond_init(&r->zwake, NULL);
+
+        lg->rot = r;
+        lg->vprintf = rotator_vprintf;
+}
+
+static void stop_rotator(Rotator *r)
+/* Waits for pending compressions. */
+{
+        pthread_mutex_lock(&r->zlock);
+        r->zstop = 1;
+        pthread_cond_signal(&r->zwake);
+        pthread_mutex_unlock(&r->zlock);
+        if(r->zstarted)
+                pthread_join(r->zthread, NULL);
+
+        pthread_rwlock_destroy(&r->swap);
+        pthread_mutex_destroy(&r->lock);
+        pthread_mutex_destroy(&r->zlock);
+        pthread_cond_destroy(&r->zwake);
+        free(r->pattern);
+        free(r->name);
+        free(r);
+}
+
+
+// Tee loggers ------.
+
+struct TeeLog {
+        int n;
+        Logger *child[];
+};
+
+static int tee_vprintf(Logger *lg, LogMeta *meta, const char *msg, va_list va)
+/* method: format the message once, then pass the text to the children. */
+{
+        TeeLog *t = lg->tee;
+        char small[ELM_LOG_LINE_STACK], *text = small;
+        va_list vcopy;
+
+        va_copy(vcopy, va);
+        int n = vsnprintf(small, sizeof small, msg, vcopy);
+        va_end(vcopy);
+        if(n < 0) {
+                emergency_message("LOGFAILED", meta, msg);
+                return -1;
+        }
+        if(n >= sizeof small) {
+                text = MALLOC(n + 1);
+                vsnprintf(text, n + 1, msg, va);
+        }
+
+        int total = 0;
+        for(int k = 0; k < t->n; k++) {
+                Logger *c = t->child[k];
+                init_static_logger(c);
+                if(!log_enabled(c, meta->level) || is_null_logger(c))
+                        continue;
+                int nc = meta_printf(c, meta, "%s", text);
+                total = nc < 0 || total < 0 ? -1 : total + nc;
+        }
+
+        if(text != small)
+                free(text);
+        return total;
+}
+
+static Error *flush_tee(TeeLog *t)
+/* Flushes every child, returning the first error. */
+{
+        Error *first = NULL;
+        for(int k = 0; k < t->n; k++) {
+                Error *err = flush_logger(t->child[k]);
+                if(!first)
+                        first = err;
+                else
+                        destroy_error(err);
+        }
+        return first;
+}
+
+static void stop_tee(TeeLog *t)
+{
+        for(int k = 0; k < t->n; k++)
+                destroy_logger(t->child[k]);
+        free(t);
+}
+
+Logger *new_tee_logger(Logger *const *children, int nchildren)
+{
+        TeeLog *t = MALLOC(sizeof(TeeLog) + nchildren * sizeof(Logger*));
+        t->n = nchildren;
+        for(int k = 0; k < nchildren; k++)
+                t->child[k] = ref_logger(children[k]);
+
+        Logger *lg = new_logger("tee", NULL, NULL);
+        lg->gate.threshold = LOG_LEVEL_DEBUG;
+        lg->tee = t;
+        lg->vprintf = tee_vprintf;
+        return lg;
+}
+
+
+// User created loggers ------.
+
+Logger *new_logger(const char *zname, FILE *stream, const char *opts)
+/* Create a standard logger that writes to "stream". */
+{
+        SPrintPrefix spp = log_prefix;
+        int async = 0, binary = 0, stamp = 0;
+        LogFlush flush = LOG_FLUSH_ALWAYS;
+        unsigned long flush_n = 0;
+
+        if(opts) {
+                int ch;
+                for(const char *o=opts; ch=*o; o++) switch(ch) {
+                case 'd': spp = dbg_prefix; continue;
+                case 'T': stamp |= LOG_STAMP_TIME; continue;
+                case 'i': stamp |= LOG_STAMP_TID; continue;
+                case 'a':
+                case 'A': async = ch; continue;
+                case 'B': binary = 1; continue;
+                case 'e': flush = LOG_FLUSH_ERRORS; continue;
+                case 'l': flush = LOG_FLUSH_LINES;    goto flush_arg;
+                case 'b': flush = LOG_FLUSH_BYTES;    goto flush_arg;
+                case 't': flush = LOG_FLUSH_INTERVAL; goto flush_arg;
+                flush_arg: {
+                        char *end;
+                        flush_n = strtoul(o + 1, &end, 10);
+                        if(end == o + 1)
+                                flush_n = flush == LOG_FLUSH_LINES ? 64 :
+                                          flush == LOG_FLUSH_BYTES ? 4096 :
+                                                                     1000;
+                        o = end - 1;
+                        continue;
+                }}
+        }
+
+        Logger *lg = malloc( sizeof(Logger) );
+        if( !lg )
+                PANIC_NOMEM();
+
+        assert(zname);
+
+        lg->gate.threshold = stream ? LOG_LEVEL_DEBUG : LOG_LEVEL_OFF;
+        lg->stream  = stream;
+        lg->async   = NULL;
+        lg->binary  = NULL;
+        lg->map     = NULL;
+        lg->rot     = NULL;
+        lg->tee     = NULL;
+        lg->owns_stream = 0;
+        lg->vprintf = log_vprintf;
+        lg->sprint_prefix = spp;
+        lg->zname = strdup(zname);
+        lg->stamp = stamp;
+        lg->flush = LOG_FLUSH_ALWAYS;
+
+        lg->nrefs = 1;
+
+        Error *err = !stream ? NULL :
+                     binary  ? start_binary(lg) :
+                     async   ? start_async(lg, async == 'A') : NULL;
+        if(err) {
+                free((char*)lg->zname);
+                free(lg);
+                panic(err);
+        }
+
+        if(lg->async)
+                link_lazy(lg);
+        logger_flush_policy(lg, flush, flush_n);
+        return lg;
+}
+
+static int opt_num(const char *opts, int ch, unsigned long dflt,
+                                             unsigned long *n)
+/* Looks for the option `ch`, setting *n to its number (or dflt). */
+{
+        const char *o = opts ? strchr(opts, ch) : NULL;
+        char *end;
+
+        *n = 0;
+        if(!o)
+                return 0;
+        *n = strtoul(o + 1, &end, 10);
+        if(end == o + 1)
+                *n = dflt;
+        return 1;
+}
+
+Logger *new_file_logger(const char *zname, const char *path, const char *opts)
+/* Create a logger that appends to the file at `path`. */
+{
+        unsigned long seg_size, max_bytes, interval_ms;
+        int mapped = opt_num(opts, 'm', 16 << 20, &seg_size);
+        int rotated = opt_num(opts, 'r', 64 << 20, &max_bytes);
+        rotated |= opt_num(opts, 'R', 3600 * 1000, &interval_ms);
+
+        if(mapped) {
+                // a logger without a stream, then give it a map instead.
+                Logger *lg = new_logger(zname, NULL, opts);
+                logger_flush_policy(lg, LOG_FLUSH_ALWAYS, 0);
+                Error *err = start_map(lg, path, seg_size);
+                if(err) {
+                        destroy_logger(lg);
+                        panic(err);
+                }
+                return lg;
+        }
+
+        char *name = rotated ? rotation_name(path, 0) : NULL;
+        FILE *f = fopen(name ? name : path, "a");
+        if(!f) {
+                Error *err = IO_ERROR(name ? name : path, errno, "opening log");
+                free(name);
+                panic(err);
+        }
+
+        // no writer thread or binary format for rotated loggers.
+        char zopts[opts ? strlen(opts) + 1 : 1], *z = zopts;
+        for(const char *o = opts; o && *o; o++)
+                if(!rotated || !strchr("aAB", *o))
+                        *z++ = *o;
+        *z = 0;
+
+        Logger *volatile lg = NULL;
+        PanicReturn ret;
+        Error *err = TRY(ret);
+        if(!err) {
+                lg = new_logger(zname, f, zopts);
+                lg->owns_stream = 1;
+                if(rotated)
+                        start_rotator(lg, path, name, max_bytes, interval_ms,
+                                      !!strchr(opts, 'z'));
+                NO_WORRIES(ret);
+        }
+
+        if(err) {
+                if(lg)
+                        destroy_logger(lg); // closes f
+                else
+                        fclose(f);
+                free(name);
+                panic(err);
+        }
+        return lg;
+}
+
+/*
+  The count of a user created logger stays positive for as long as anyone may
+  call these, and that of a static logger is never positive.  So the sign can
+  be tested without a race before changing the count.
+*/
+
+Logger *ref_logger(Logger *lg)
+{
+        if(__atomic_load_n(&lg->nrefs, __ATOMIC_RELAXED) > 0)
+                __atomic_fetch_add(&lg->nrefs, 1, __ATOMIC_RELAXED);
+        return lg;
+}
+
+Error *destroy_logger(Logger *lg)
+/* Frees a non-builtin logger. */
+{
+        if(!lg)
+                return NULL;
+        if(__atomic_load_n(&lg->nrefs, __ATOMIC_RELAXED) <= 0)
+                return NULL; // static logger, do not touch.
+        if(__atomic_sub_fetch(&lg->nrefs, 1, __ATOMIC_ACQ_REL))
+                return NULL;
+
+        // nobody else can use lg now, but its last words need a live logger
+        __atomic_store_n(&lg->nrefs, 1, __ATOMIC_RELAXED);
+        report_suppressed(lg, 1);
+
+        if(is_lazy(lg))
+                unlink_lazy(lg);
+        if(lg->async)
+                stop_async(lg->async);
+        else if(lg->stream)
+                fflush(lg->stream);
+        if(lg->binary)
+                stop_binary(lg->binary);
+        if(lg->map)
+                stop_map(lg->map);
+        if(lg->owns_stream)
+                fclose(lg->stream);
+        if(lg->rot)
+                stop_rotator(lg->rot);
+        if(lg->tee)
+                stop_tee(lg->tee);
+        free((char*)lg->zname);
+        free(lg);
+        return NULL;
+}
+
+int set_log_level(Logger *lg, int threshold)
+{
+        int old = lg->gate.threshold;
+        lg->gate.threshold = threshold;
+        return old;
+}
+
+Error *flush_logger(Logger *lg)
+/* Wait until everything logged so far has reached the stream. */
+{
+        init_static_logger(lg);
+        if(is_null_logger(lg))
+                return NULL;
+        report_suppressed(lg, 0);
+        if(lg->tee)
+                return flush_tee(lg->tee);
+
+        if(flush_stream(lg) == EOF)
+                return SYS_ERROR(errno, "flushing log %s", lg->zname);
+        return NULL;
+}
+
+size_t logger_ndropped(Logger *lg)
+{
+        AsyncQueue *q = lg->async;
+        return q ? __atomic_load_n(&q->ndropped, __ATOMIC_RELAXED) : 0;
+}
+
+
+static int vlog_at(Logger *lg, int level, const char *file, int line,
+                   const char *func, const char *msg, va_list va)
+{
+        _elm_crash_note(level, file, line, func, msg);
+        init_static_logger(lg);
+        if(is_null_logger(lg))
+                return 0;
+
+        assert(lg);
+        LogMeta m = {
+                file : file,
+                line : line,
+                func : func,
+                tid  : thread_id(),
+                time_ns : clock_ns(),
+                level : level,
+        };
+        return lg->vprintf(lg, &m, msg, va);
+}
+
+int log_f(Logger *lg,
+           const char *file,
+           int         line,
+           const char *func,
+           const char *msg, ...)
+/* Format a message vprintf style, then log it. */
+{
+        va_list va;
+        va_start(va, msg);
+        int n = vlog_at(lg, LOG_LEVEL_ALWAYS, file, line, func, msg, va);
+        va_end(va);
+        return n;
+}
+
+int log_at(Logger *lg, int level,
+           const char *file,
+           int         line,
+           const char *func,
+           const char *msg, ...)
+/* Like log_f(), but tell the logger the level of the message. */
+{
+        va_list va;
+        va_start(va, msg);
+        int n = vlog_at(lg, level, file, line, func, msg, va);
+        va_end(va);
+        return n;
+}
+
+
+
+// Malloc ---------------------------------------------------------------------
+/*
+        A malloc() wrapper that checks the results and exits on failure, after
+        printing an error message to stderr.  These are macros, not functions,
+        because they gather source-location metadata.
+
+        MALLOC(N)     - Allocate N bytes (or die trying).
+        ZALLOC(N)     - Allocate N zeroed bytes.
+        PANIC_NOMEM() - Called when malloc fails.
+
+        You can call PANIC_NOMEM yourself, if detect an out of memory
+        condition.  Or if you want to supply your own metadata, you can call
+
+        void panic_nomem(const char* file, int line, const char *func)
+
+        In future, the exit might not be unconditional.  The panic might
+        conditionally do a longjmp to a place where you can try to carry on.
+*/
+
+static int nomem_fwrite(Error *e, FILE *out);
+
+static const ErrorType _nomem_error_type = {
+        fwrite    : nomem_fwrite,
+        cleanup   : NULL,
+};
+
+const ErrorType *const nomem_error_type = &_nomem_error_type;
+
+/* Per-thread, so that concurrent out-of-memory panics don't trample each
+   other's metadata. */
+static __thread Error nomem_error =  {
+        .type = &_nomem_error_type,
+        .meta = {
+                .line = -1,
+                .file = "",
+                .func = "",
+        }
+};
+
+static int nomem_fwrite(Error *e, FILE *out)
+{
+        return emergency_message("NOMEM", &nomem_error.meta, "Out of virtual memory");
+}
+
+Error *error_nomem(const char* file, int line, const char *func)
+{
+        nomem_error.meta = (LogMeta){
+                file : file,
+                line : line,
+                func : func,
+        };
+        return &nomem_error;
+}
+
+static PanicRescue nomem_rescue = no_rescue;
+
+PanicRescue panic_rescue_nomem(PanicRescue new_rescue)
+{
+        PanicRescue old = nomem_rescue;
+        if(new_rescue)
+                nomem_rescue = new_rescue;
+        return old;
+}
+
+void *malloc_or_die(const char* file, int line, const char *func, size_t n)
+{
+        void *ret = malloc(n);
+        if(ret)
+                return ret;
+        if(!nomem_rescue() && (ret = malloc(n)))
+                return ret;
+
+        panic_nomem(file, line, func);
+        return 0;
+}
+
+// -- Arenas
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+
+typedef union {
+        long double ld;
+        long long   ll;
+        void       *p;
+        void      (*fn)();
+} MaxAlign;
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+        ArenaChunk *prev;       // the previously allocated chunk
+        size_t      size;       // of data[]
+        MaxAlign    data[];
+};
+
+struct Arena {
+        ArenaChunk *chunk;      // the newest chunk, in which we are bumping
+        size_t      used;       // bytes of chunk->data already handed out
+        size_t      chunk_size;
+};
+
+Arena *new_arena(size_t chunk_size)
+{
+        Arena *a = MALLOC(sizeof(Arena));
+        *a = (Arena){
+                .chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK,
+        };
+        return a;
+}
+
+void *arena_alloc_or_die(Arena *a, const char* file, int line,
+                                   const char *func, size_t n)
+{
+        size_t align = sizeof(MaxAlign);
+        if(n > SIZE_MAX - sizeof(ArenaChunk) - align)
+                panic_nomem(file, line, func);
+        n = (n + align - 1) / align * align;
+
+        ArenaChunk *c = a->chunk;
+        if(!c || c->size - a->used < n) {
+                size_t size = n > a->chunk_size ? n : a->chunk_size;
+                c = malloc_or_die(file, line, func, sizeof(ArenaChunk) + size);
+                c->prev = a->chunk;
+                c->size = size;
+                a->chunk = c;
+                a->used = 0;
+        }
+
+        void *ret = (char*)c->data + a->used;
+        a->used += n;
+        return ret;
+}
+
+void reset_arena(Arena *a)
+/* Free all but the oldest chunk, and start again at its beginning. */
+{
+        ArenaChunk *c = a->chunk;
+        if(!c)
+                return;
+
+        while(c->prev) {
+                ArenaChunk *prev = c->prev;
+                free(c);
+                c = prev;
+        }
+        a->chunk = c;
+        a->used = 0;
+}
+
+void destroy_arena(Arena *a)
+{
+        if(!a)
+                return;
+
+        reset_arena(a);
+        free(a->chunk);
+        free(a);
+}
+
+static pthread_key_t thread_arena_key;
+static pthread_once_t thread_arena_once = PTHREAD_ONCE_INIT;
+static __thread Arena *_thread_arena;
+
+static void make_thread_arena_key()
+{
+        pthread_key_create(&thread_arena_key, (void(*)(void*))destroy_arena);
+}
+
+Arena *thread_arena()
+{
+        if(_thread_arena)
+                return _thread_arena;
+
+        pthread_once(&thread_arena_once, make_thread_arena_key);
+        _thread_arena = new_arena(0);
+        pthread_setspecific(thread_arena_key, _thread_arena);
+        return _thread_arena;
+}
+
+// -- Pools
+/*
+  Each thread finds its PoolCache for a pool in a table of its own, indexed by
+  the pool's id; there is just one pthread key for all pools, whose destructor
+  frees the table when the thread exits.  Ids are reused once their pool is
+  destroyed, so a slot also records the serial number of the pool it was
+  filled for, which is never reused; a slot left by a dead pool is ignored.
+*/
+
+typedef struct PoolCache PoolCache;
+struct PoolCache {
+        /* Per-thread state of a Pool. */
+        Pool      *pool;
+        PoolCache *next, **pprev;  // in pool->caches
+        void      *free;           // a list linked through the first word
+        size_t     nfree, nhits, nmisses;
+};
+
+struct Pool {
+        size_t size, nkeep;
+        size_t id;              // the index of this pool's PoolSlot
+        unsigned long serial;
+        pthread_mutex_t lock;   // guards the fields below
+        PoolCache *caches;
+        size_t nhits, nmisses;  // totals from exited threads
+};
+
+typedef struct {
+        PoolCache *cache;
+        unsigned long serial;
+} PoolSlot;
+
+typedef struct {
+        size_t n;
+        PoolSlot slot[];
+} PoolTable;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pool **pools;            // the live pools, by id
+static size_t npools;           // the length of `pools`
+static unsigned long pool_serial;
+
+static pthread_key_t pool_table_key;
+static pthread_once_t pool_table_once = PTHREAD_ONCE_INIT;
+static int pool_table_key_err;
+static __thread PoolTable *_pool_table;
+
+static void free_pool_cache(PoolCache *pc)
+/* Called with pc->pool->lock held. */
+{
+        Pool *pl = pc->pool;
+        pl->nhits += pc->nhits;
+        pl->nmisses += pc->nmisses;
+
+        for(void *obj = pc->free, *next; obj; obj = next) {
+                next = *(void**)obj;
+                free(obj);
+        }
+        if((*pc->pprev = pc->next))
+                pc->next->pprev = pc->pprev;
+        free(pc);
+}
+
+static void pool_thread_exit(void *arg)
+/* Free the caches of the exiting thread, for the pools still alive. */
+{
+        PoolTable *t = arg;
+        pthread_mutex_lock(&pools_lock);
+        for(size_t k = 0; k < t->n; k++) {
+                PoolSlot *s = t->slot + k;
+                Pool *pl = k < npools ? pools[k] : NULL;
+                if(!s->cache || !pl || pl->serial != s->serial)
+                        continue;
+                pthread_mutex_lock(&pl->lock);
+                free_pool_cache(s->cache);
+                pthread_mutex_unlock(&pl->lock);
+        }
+        pthread_mutex_unlock(&pools_lock);
+        free(t);
+        _pool_table = NULL;
+}
+
+static void make_pool_table_key()
+{
+        pool_table_key_err = pthread_key_create(&pool_table_key,
+                                                pool_thread_exit);
+}
+
+static PoolCache *find_pool_cache(Pool *pl)
+/* This thread's cache for pl, or NULL if it has none. */
+{
+        PoolTable *t = _pool_table;
+        if(!t || pl->id >= t->n || t->slot[pl->id].serial != pl->serial)
+                return NULL;
+        return t->slot[pl->id].cache;
+}
+
+static PoolCache *pool_cache(Pool *pl, const char* file, int line,
+                                       const char *func)
+{
+        PoolCache *pc = find_pool_cache(pl);
+        if(pc)
+                return pc;
+
+        PoolTable *t = _pool_table;
+        if(!t || pl->id >= t->n) {
+                size_t n = t ? 2 * t->n : 8;
+                while(n <= pl->id)
+                        n *= 2;
+                PoolTable *more = malloc_or_die(file, line, func,
+                                        sizeof *t + n * sizeof *t->slot);
+                more->n = n;
+                memset(more->slot, 0, n * sizeof *more->slot);
+                if(t) {
+                        memcpy(more->slot, t->slot, t->n * sizeof *t->slot);
+                        free(t);
+                } else {
+                        pthread_once(&pool_table_once, make_pool_table_key);
+                        if(pool_table_key_err) {
+                                free(more);
+                                SYS_PANIC(pool_table_key_err,
+                                          "creating pool key");
+                        }
+                }
+                _pool_table = t = more;
+                pthread_setspecific(pool_table_key, t);
+        }
+
+        pc = malloc_or_die(file, line, func, sizeof(PoolCache));
+        *pc = (PoolCache){ .pool = pl };
+
+        pthread_mutex_lock(&pl->lock);
+        if((pc->next = pl->caches))
+                pc->next->pprev = &pc->next;
+        pc->pprev = &pl->caches;
+        pl->caches = pc;
+        pthread_mutex_unlock(&pl->lock);
+
+        t->slot[pl->id] = (PoolSlot){ .cache = pc, .serial = pl->serial };
+        return pc;
+}
+
+Pool *new_pool(size_t size, size_t nkeep)
+{
+        Pool *pl = MALLOC(sizeof(Pool));
+        pl->size = size < sizeof(void*) ? sizeof(void*) : size;
+        pl->nkeep = nkeep;
+        pl->caches = NULL;
+        pl->nhits = pl->nmisses = 0;
+        pthread_mutex_init(&pl->lock, NULL);
+
+        pthread_mutex_lock(&pools_lock);
+        size_t id = 0;
+        while(id < npools && pools[id])
+                id++;
+        if(id == npools) {
+                size_t n = npools ? 2 * npools : 16;
+                Pool **more = realloc(pools, n * sizeof *pools);
+                if(!more) {
+                        pthread_mutex_unlock(&pools_lock);
+                        free(pl);
+                        PANIC_NOMEM();
+                }
+                memset(more + npools, 0, (n - npools) * sizeof *more);
+                pools = more;
+                npools = n;
+        }
+        pl->id = id;
+        pl->serial = ++pool_serial;
+        pools[id] = pl;
+        pthread_mutex_unlock(&pools_lock);
+        return pl;
+}
+
+void *pool_get_or_die(Pool *pl, const char* file, int line, const char *func)
+{
+        PoolCache *pc = pool_cache(pl, file, line, func);
+        void *obj = pc->free;
+        if(obj) {
+                pc->free = *(void**)obj;
+                pc->nfree--;
+                __atomic_store_n(&pc->nhits, pc->nhits + 1, __ATOMIC_RELAXED);
+                return obj;
+        }
+
+        __atomic_store_n(&pc->nmisses, pc->nmisses + 1, __ATOMIC_RELAXED);
+        return malloc_or_die(file, line, func, pl->size);
+}
+
+void pool_put(Pool *pl, void *obj)
+{
+        if(!obj)
+                return;
+
+        PoolCache *pc = find_pool_cache(pl);
+        if(!pc || pl->nkeep && pc->nfree >= pl->nkeep) {
+                free(obj);
+                return;
+        }
+
+        *(void**)obj = pc->free;
+        pc->free = obj;
+        pc->nfree++;
+}
+
+void pool_stats(Pool *pl, size_t *nhits, size_t *nmisses)
+{
+        pthread_mutex_lock(&pl->lock);
+        size_t h = pl->nhits, m = pl->nmisses;
+        for(PoolCache *pc = pl->caches; pc; pc = pc->next) {
+                h += __atomic_load_n(&pc->nhits, __ATOMIC_RELAXED);
+                m += __atomic_load_n(&pc->nmisses, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&pl->lock);
+
+        if(nhits)
+                *nhits = h;
+        if(nmisses)
+                *nmisses = m;
+}
+
+void destroy_pool(Pool *pl)
+{
+        if(!pl)
+                return;
+
+        // After this, exiting threads no longer free pl's caches, and its id
+        // may be reused (but not its serial).
+        pthread_mutex_lock(&pools_lock);
+        pools[pl->id] = NULL;
+        pthread_mutex_unlock(&pools_lock);
+
+        pthread_mutex_lock(&pl->lock);
+        while(pl->caches)
+                free_pool_cache(pl->caches);
+        pthread_mutex_unlock(&pl->lock);
+
+        pthread_mutex_destroy(&pl->lock);
+        free(pl);
+}
+
+// -- Panic ----------------------------
+
+/* Each thread has its own chain of PanicReturns, so TRY and panic() in one
+   thread never see the handlers of another. */
+static __thread PanicReturn *_panic_return;
+
+/* Handlers pushed outside any TRY, run by death_panic(). */
+static __thread UnwindStack root_unwind;
+
+static UnwindStack *unwind_stack()
+{
+        return _panic_return ? &_panic_return->unwind : &root_unwind;
+}
+
+static void run_unwind(UnwindStack *us)
+{
+        while(us->n > 0) {
+                us->n--;
+                us->h[us->n].fn(us->h[us->n].ptr);
+        }
+}
+
+void push_unwind(void (*fn)(void *ptr), void *ptr)
+{
+        UnwindStack *us = unwind_stack();
+        if(us->n == ELM_MAX_UNWIND) {
+                fn(ptr);
+                PANIC("More than %d unwind handlers.", ELM_MAX_UNWIND);
+        }
+
+        us->h[us->n].fn = fn;
+        us->h[us->n].ptr = ptr;
+        us->n++;
+}
+
+void pop_unwind(int run)
+{
+        UnwindStack *us = unwind_stack();
+        assert(us->n > 0);
+        us->n--;
+        if(run)
+                us->h[us->n].fn(us->h[us->n].ptr);
+}
+
+Error *_panic_pop(PanicReturn *check)
 {
         assert(_panic_return);
         assert(_panic_return == check);
+        assert(check->unwind.n == 0);
         _panic_return = _panic_return->prev;
         return check->error;
 }
 
 static void throw_panic(Error *err)
 {
-        assert(_panic_return);
-        _panic_return->error = err;
-        longjmp(_panic_return->jmp_buf, -1);
+        PanicReturn *ret = _panic_return;
+        assert(ret);
+        ret->error = err;
+        run_unwind(&ret->unwind);
+
+        switch(ret->jmp_kind) {
+        case _PANIC_JMP_sigsetjmp:
+                siglongjmp(ret->jb.sigjmp, -1);
+#ifdef __GNUC__
+        case _PANIC_JMP_builtin:
+                __builtin_longjmp(ret->jb.builtin, 1);
+#endif
+        default:
+                longjmp(ret->jb.jmp, -1);
+        }
 }
 
-int _panic_set_return(PanicReturn *ret)
+int _panic_set_return(PanicReturn *ret, int jmp_kind)
 {
         ret->prev  = _panic_return;
         ret->error = 0;
+        ret->jmp_kind = jmp_kind;
+        ret->unwind.n = 0;
         _panic_return = ret;
         return 0;
 }
@@ -594,7 +3194,12 @@ static void death_panic(Error *e)
         Logger panic_log = _elm_dbg_log;
         panic_log.zname = "PANIC!";
 
+        panic_log.flush = LOG_FLUSH_ALWAYS;
+
+        flush_lazy_loggers();
         log_error( &panic_log, e);
+        dump_crash_ring(2);
+        run_unwind(&root_unwind);
 
         exit(e->type == nomem_error_type ? ENOMEM : sys_error(e, NULL, NULL));
 }
@@ -70,16 +70,23 @@ extern const char *elm_version();
 
 /*
   Many parts of elm use the LogMeta struct to hold metadata about various
-  events that happen in the program.  For now these metadata are only the
-  source code location (filename, line number, function) where the event
-  occurred.  In future we might include things like timestamps.
+  events that happen in the program: the source code location (filename, line
+  number, function) where the event occurred, and when and in which thread it
+  happened.
 */
 typedef struct LogMeta LogMeta;
 struct LogMeta {
         const char *func;
         const char *file;
         int line;
+        long tid;          // thread id (as in gettid()), or 0 if unknown
+        long long time_ns; // nanoseconds since the epoch, or 0 if unknown
+        int level;         // of a log message (LOG_LEVEL_ERROR for errors)
 };
+/*
+  The time is read from a coarse clock (on Linux it ticks every few
+  milliseconds), which makes stamping every log message and error cheap.
+*/
 
 
 /*-- Errors -------------------------------------------------------------------
@@ -119,8 +126,12 @@ typedef const struct ErrorType ErrorType;
         return ERROR("There were %d %s sitting on the wall.", -3, "bottles");
 
   The formated message will be printed every time `error_fwrite` is called.
+
+  Creating errors is cheap: destroyed errors are kept on a per-thread free list
+  for reuse, and short messages are stored inside the error itself, so usually
+  neither ERROR nor `destroy_error` calls malloc() or free().
 */
-ErrorType *const error_type;
+extern const ErrorType *const error_type;
 #define ERROR(...) ERROR_WITH(error, __VA_ARGS__)
 
 /*
@@ -239,6 +250,23 @@ extern int sys_error(Error *e, char **zname, char **zmsg);
    free()'able buffers.
 */
 
+/*
+  Formatting a message takes time, which is wasted if the error is destroyed
+  (e.g. by keep_first_error) without ever being written.  A lazy error instead
+  records its format and a copy of each argument, and formats the message only
+  when `error_fwrite` (or `log_error`) needs it:
+
+        return LAZY_ERROR("Unexpected %s on line %d.", ztoken, nline);
+
+  String arguments are copied, so they need not outlive the error, but the
+  format itself is not (so it should be a literal).  Formats that can't be
+  deferred (with %n, %m or positional arguments) are formatted immediately.
+*/
+extern Error *init_lazy_error(Error *e, const char *zfmt, ...) CHECK_FMT(2);
+extern const ErrorType *const lazy_error_type;
+#define LAZY_ERROR(...) init_lazy_error(ERROR_ALLOC(lazy_error), __VA_ARGS__)
+#define LAZY_PANIC(...) panic(LAZY_ERROR(__VA_ARGS__))
+
 
 /*-- Panic --------------------------------------------------------------------
   Extreme errors can be handled using panic(), which either:
@@ -247,6 +275,9 @@ extern int sys_error(Error *e, char **zname, char **zmsg);
 
   Be warned, this is C, there is no garbage collection or automatic destructor
   calling, which can make stack unwinding less useful than in other languages.
+
+  Panic-catching is per-thread: a panic() unwinds only to a TRY made by the
+  same thread, and if there is none the whole process dies as usual.
 */
 
 /* You can panic using an valid (and non-NULL) error object by calling. */
@@ -273,10 +304,36 @@ static inline void panic_if(Error *e)
     the macro TRY(R)
 */
 typedef struct PanicReturn PanicReturn;
+typedef struct UnwindStack UnwindStack; // see push_unwind below
+
+#define ELM_MAX_UNWIND 8
+struct UnwindStack {
+        int n;
+        struct {
+                void (*fn)(void *ptr);
+                void  *ptr;
+        } h[ELM_MAX_UNWIND];
+};
+
+/* Strict C hides sigjmp_buf in glibc, where it is the same type as jmp_buf. */
+#if defined(__GLIBC__) && !defined(__USE_POSIX)
+#define _ELM_HAVE_SIGJMP 0
+#else
+#define _ELM_HAVE_SIGJMP 1
+#endif
+
 struct PanicReturn {
-        jmp_buf jmp_buf; /*MUST be first*/
+        union {                         /*what TRY saved; see ELM_TRY_JMP*/
+                jmp_buf     jmp;
+#if _ELM_HAVE_SIGJMP
+                sigjmp_buf  sigjmp;
+#endif
+                void       *builtin[5];
+        } jb;
         PanicReturn *prev;
         Error       *error;
+        int          jmp_kind;
+        UnwindStack  unwind;
 };
 
 /*
@@ -323,13 +380,73 @@ struct PanicReturn {
 
 /*
    If you ever want to know whether or not you are inside a TRY/NO_WORRIES
-   pair, you can call
+   pair (in the calling thread), you can call
  */
 int panic_is_caught();
 
-#define _PANIC_SET(R) (_panic_set_return(&(R))||setjmp(*(jmp_buf*)(&R)))
+/*
+   A panic jumps straight back to the TRY, so anything acquired in between
+   leaks unless you register a handler to release it:
+*/
+extern void push_unwind(void (*fn)(void *ptr), void *ptr);
+extern void pop_unwind(int run);
+/*
+   push_unwind adds a handler to the innermost TRY of the calling thread, and
+   pop_unwind removes the most recently added one, calling it first if `run` is
+   non-zero.  When panic() unwinds to a TRY it calls that TRY's handlers, most
+   recent first, as fn(ptr).  For example:
+
+        FILE *f = fopen(...);
+        push_unwind((void(*)(void*))fclose, f);
+        ... something which might panic() ...
+        pop_unwind(1); // fclose(f)
+
+   Handlers should not panic.  Every handler pushed after a TRY must be popped
+   before its NO_WORRIES.  Each TRY has room for ELM_MAX_UNWIND handlers, so
+   registering one costs no allocation; if there is no room, push_unwind calls
+   fn(ptr) immediately and then panics.  Handlers pushed outside any TRY are
+   called if panic() exits the process.
+*/
+
+/*
+   TRY saves the registers of the calling function using setjmp().  Since TRY
+   is usually entered and left many times for every panic, you might want a
+   cheaper way of saving them, which you choose by compiling with
+   -DELM_TRY_JMP=K, where K is one of
+
+        setjmp          the default.
+        sigsetjmp       sigsetjmp() without saving the signal mask (which some
+                        libcs' setjmp does); needs POSIX, so define
+                        _POSIX_C_SOURCE (or _GNU_SOURCE) before including
+                        any header if you compile with -std=c99.
+        builtin         GCC's __builtin_setjmp, which saves only what the
+                        compiler needs to resume.
+
+   Code compiled with different choices can be mixed, since each PanicReturn
+   records how it must be resumed.
+*/
+#ifndef ELM_TRY_JMP
+#define ELM_TRY_JMP setjmp
+#endif
+#define _PANIC_IS_SIGSETJMP(K) _PANIC_IS_SIGSETJMP_(K)
+#define _PANIC_IS_SIGSETJMP_(K) _PANIC_IS_##K
+#define _PANIC_IS_sigsetjmp 1
+#if _PANIC_IS_SIGSETJMP(ELM_TRY_JMP) && !_ELM_HAVE_SIGJMP
+#error "ELM_TRY_JMP=sigsetjmp needs POSIX: define _POSIX_C_SOURCE"
+#endif
+
+#define _PANIC_SET(R) _PANIC_SET_WITH(ELM_TRY_JMP, R)
+#define _PANIC_SET_WITH(K, R) _PANIC_SET_WITH_(K, R)
+#define _PANIC_SET_WITH_(K, R) \
+        (_panic_set_return(&(R), _PANIC_JMP_##K) || _panic_jmp_##K(R))
+
+enum { _PANIC_JMP_setjmp, _PANIC_JMP_sigsetjmp, _PANIC_JMP_builtin };
+#define _panic_jmp_setjmp(R)    setjmp((R).jb.jmp)
+#define _panic_jmp_sigsetjmp(R) sigsetjmp((R).jb.sigjmp, 0)
+#define _panic_jmp_builtin(R)   (__builtin_setjmp((R).jb.builtin) ? -1 : 0)
+
 extern Error *_panic_pop(PanicReturn *check);
-extern int _panic_set_return(PanicReturn *ret);
+extern int _panic_set_return(PanicReturn *ret, int jmp_kind);
 
 /* One common reason to catch serious errors is in unit tests - to see that
    code is throwing them when it should.  Assuming you use 0unit, you can make
@@ -401,10 +518,119 @@ extern Logger *new_logger(const char *zname, FILE *stream, const char *opts);
   messages.
 
   You can modify the style of logging by setting "opts" to be non-NULL, this
-  string is just a list of option charactors, the only one defined so far is
-  'd' which causes the logger to print out the source location metadata (like
-  the debug logger).  All other option characters are ignored, in this version
-  of elm.  opts==NULL is equivalent to opts="".
+  string is just a list of option charactors:
+
+        'd'  print out the source location metadata (like the debug logger).
+        'T'  print the time (UTC, to the millisecond) before each message.
+        'i'  print the thread id before each message.
+        'a'  log asynchronously (see below); callers block if the queue is full.
+        'A'  log asynchronously, but drop messages if the queue is full.
+        'B'  log in binary (see below), 'a' and 'A' are then ignored.
+        'e'  fflush() the stream only after log_error() (see below).
+        'lN' fflush() the stream after every N messages (default 64).
+        'bN' fflush() the stream once N bytes are pending (default 4096).
+        'tN' fflush() the stream at most every N milliseconds (default 1000).
+
+  All other option characters are ignored, in this version of elm.  opts==NULL
+  is equivalent to opts="".
+
+  To log to a file, you can instead call
+*/
+extern Logger *new_file_logger(const char *zname, const char *path,
+                                                  const char *opts);
+/*
+  which opens the file at `path` for appending (it panics if it can't), and
+  closes it when the logger is destroyed.  It takes all the same options, and
+  also
+
+        'mN' memory-map the file, in segments of N bytes (default 16 MiB).
+
+  A memory-mapped logger formats each message on the stack and copies it into
+  the mapping, so that logging takes no system calls.  Text written this way
+  survives a crash of the process (the kernel still has it).  When a segment
+  is full, it is renamed to "<path>.<k>", for the first k = 1, 2 ... that is
+  not taken, and a new segment is started at `path`.  Because the file is
+  extended before it is written, a crash can leave NUL bytes at its end; they
+  are overwritten when the file is next opened.  The options 'a', 'A', 'B' and
+  the flush options do not apply to memory-mapped loggers.
+
+  Other file loggers can instead rotate their files, with the options
+
+        'rN' start a new file once N bytes were written (default 64 MiB).
+        'RN' start a new file every N milliseconds (default one hour).
+        'z'  gzip each file after it is closed (by running gzip(1) from a
+             background thread).
+
+  When rotating, `path` is a pattern passed to strftime() with the current UTC
+  time, e.g. "/var/log/app-%Y%m%d-%H%M.log".  When the name it gives is taken
+  (because it is the current file) ".<k>" is appended, for the first k that
+  gives a new file.  The new file is opened before any lock is taken, so other
+  threads wait only while the logger switches streams.  The options 'a', 'A'
+  and 'B' do not apply to rotating loggers, and 'm' excludes rotation.
+
+  An asynchronous logger formats each message into a preallocated in-memory
+  queue and returns without touching the stream.  A dedicated writer thread
+  sends the queued text to the stream in large batches.  Messages longer than
+  ELM_ASYNC_LINE_MAX (512) bytes are truncated.  With 'A', the number of
+  dropped messages is counted, and reported in the log itself once the queue
+  has room again.  You can read the count with:
+*/
+size_t logger_ndropped(Logger *lg);
+/*
+  A binary logger does not format messages at all.  Instead it writes the raw
+  values of the arguments to its stream, along with the address of the format
+  string, the source location and a timestamp.  The text is recovered later
+  (on the same kind of machine) by the `elm-decode` program, or by calling
+*/
+extern Error *log_decode(FILE *in, FILE *out, const char *opts);
+/*
+  which reads a binary log from `in` and writes to `out` exactly the text that
+  an ordinary logger with the same name and 'd', 'T' and 'i' options would
+  have written.
+  If `opts` contains 't', each line is preceded by its timestamp.  Formats
+  using %n, %m, positional arguments or wide characters are formatted when
+  logged, just as with an ordinary logger.
+
+  To send the same messages to several loggers, call
+*/
+extern Logger *new_tee_logger(Logger *const *children, int nchildren);
+/*
+  which returns a logger that formats each message once, then passes the text
+  to every child whose threshold (see set_log_level below) passes the level of
+  the message.  Each child decorates the text in its own way, so one child
+  might write to a file with timestamps while another writes in binary.  The
+  tee holds a reference to each child, and drops them when it is destroyed;
+  its own threshold filters messages before any of them.
+
+  To wait until all messages logged so far have reached the stream (and the
+  stream has been fflush()ed) call:
+*/
+Error *flush_logger(Logger *lg);
+/*
+  This works for every kind of logger; a tee flushes each of its children.
+
+  By default a logger fflush()es its stream after every message, which costs a
+  write(2) per line.  You can choose a cheaper policy with the options above,
+  or at any time using:
+*/
+typedef enum {
+        LOG_FLUSH_ALWAYS = 0, // after every message (the default)
+        LOG_FLUSH_LINES,      // after every n messages
+        LOG_FLUSH_BYTES,      // once n bytes have been written since the last
+        LOG_FLUSH_INTERVAL,   // on the first message n milliseconds after the last
+        LOG_FLUSH_ERRORS,     // only after log_error() (n is ignored)
+} LogFlush;
+
+extern void logger_flush_policy(Logger *lg, LogFlush policy, unsigned long n);
+/*
+  Only two things flush regardless of the policy: an uncaught panic flushes
+  all loggers which have pending messages before the process dies, and
+  `destroy_logger` flushes the logger it destroys.  A panic caught by TRY
+  flushes nothing, so with any policy but LOG_FLUSH_ALWAYS the messages logged
+  before it may stay buffered for as long as the process keeps running.  If
+  they must be on disk by the time you handle the error (say, before you
+  report it elsewhere), call flush_logger() in the handler.  Asynchronous
+  loggers ignore the policy, their writer thread flushes after every batch.
 
   Loggers are reference counted, you can increment and decrement references
   using:
@@ -414,7 +640,10 @@ Error *destroy_logger(Logger *lg);
 /*
   (In spite of its name, `destroy_logger` only destroys the logger when
   the reference count drops to zero).  These function do nothing at all
-  to the standard (statically allocated) loggers.
+  to the standard (statically allocated) loggers.  The count is atomic, so
+  threads sharing a logger can each hold and drop their own references.
+  Destroying an asynchronous logger first writes out everything in its queue,
+  then stops its writer.
 */
 
 /*
@@ -425,16 +654,179 @@ Error *destroy_logger(Logger *lg);
         "..."    are zero or more arguments to munge into the string.
 
   This macro returns the number of bytes written to the output stream, or -1 on
-  error, in which case errno is set appropriately.
+  error, in which case errno is set appropriately.  If the logger is a null
+  logger, it returns 0 without evaluating the arguments after "fmt".
 */
 
-#define LOG_F(L,...) log_f(L, __FILE__, __LINE__, __func__,  __VA_ARGS__)
+#define LOG_F(L,...) LOG_AT(LOG_LEVEL_ALWAYS, L, __VA_ARGS__)
 extern int log_f(Logger *lg,
            const char *file,
            int         line,
            const char *func,
            const char *fmt,
            ...) CHECK_FMT(5);
+extern int log_at(Logger *lg, int level,
+           const char *file,
+           int         line,
+           const char *func,
+           const char *fmt,
+           ...) CHECK_FMT(6);
+
+/*
+  Messages can also be given a severity level, and each logger has a threshold
+  below which it ignores messages:
+*/
+enum {
+        LOG_LEVEL_DEBUG = 0,
+        LOG_LEVEL_INFO,
+        LOG_LEVEL_WARN,
+        LOG_LEVEL_ERROR,
+        LOG_LEVEL_ALWAYS, // the level of LOG_F, it passes every threshold ...
+        LOG_LEVEL_OFF,    // ... except this one, which null loggers have.
+};
+
+#define LOG_DEBUG_F(L, ...) LOG_AT(LOG_LEVEL_DEBUG, L, __VA_ARGS__)
+#define LOG_INFO_F(L, ...)  LOG_AT(LOG_LEVEL_INFO,  L, __VA_ARGS__)
+#define LOG_WARN_F(L, ...)  LOG_AT(LOG_LEVEL_WARN,  L, __VA_ARGS__)
+#define LOG_ERROR_F(L, ...) LOG_AT(LOG_LEVEL_ERROR, L, __VA_ARGS__)
+
+/*
+  New loggers start with the threshold LOG_LEVEL_DEBUG (they accept everything)
+  and so do the builtin ones, except null_log.  You can change it with
+*/
+extern int set_log_level(Logger *lg, int threshold);
+/*
+  which returns the previous threshold.
+
+  The threshold is checked inline, before any of the message arguments are
+  evaluated, so a filtered message costs only a compare and branch.  For
+  messages you don't even want that for, compile with -DELM_LOG_MIN_LEVEL=...;
+  all messages with a lower (constant) level then compile to nothing.
+
+  Note that these macros evaluate their logger argument twice.
+*/
+#ifndef ELM_LOG_MIN_LEVEL
+#define ELM_LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(LVL, L, ...)                                              \
+        ((LVL) < ELM_LOG_MIN_LEVEL ? 0 :                                 \
+         log_enabled((L), (LVL)) ?                                       \
+          log_at((L), (LVL), __FILE__, __LINE__, __func__, __VA_ARGS__) : \
+          (_elm_crash_note((LVL), __FILE__, __LINE__, __func__,          \
+                           _ELM_FIRST(__VA_ARGS__, 0)), 0))
+#define _ELM_FIRST(X, ...) X
+
+/*
+  Each thread also remembers where its most recent messages were logged, even
+  those its loggers filtered out (including everything sent to null_log).  If
+  panic() kills the process, these are written to stderr after the error, as
+  lines like
+
+        RECENT DEBUG (in main.c:42:parse): read %zu bytes from %s
+
+  Only the format is kept, since filtered messages never evaluate their
+  arguments; so it should be a string constant.  Remembering a message costs a
+  few stores, into a ring of ELM_CRASH_RING (by default 32) slots per thread.
+  The ring of the calling thread can also be written to any file descriptor by
+*/
+extern void dump_crash_ring(int fd);
+/*
+  which is async-signal-safe.  To have it called when the process dies from
+  SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT, call
+*/
+extern void install_crash_handlers(void);
+/*
+  The handlers dump the ring of the thread that got the signal, then restore
+  the default action and raise the signal again.
+*/
+
+#ifndef ELM_CRASH_RING
+#define ELM_CRASH_RING 32
+#endif
+
+typedef struct {
+        const char *file, *func, *fmt;
+        int line, level;
+} ElmCrashNote;
+
+typedef struct {
+        unsigned n;
+        ElmCrashNote note[ELM_CRASH_RING];
+} ElmCrashRing;
+
+extern __thread ElmCrashRing _elm_crash_ring;
+
+/* Inline, so that a filtered message costs only these stores. */
+static inline void _elm_crash_note(int level, const char *file, int line,
+                                   const char *func, const char *fmt)
+{
+        unsigned n = _elm_crash_ring.n;
+        ElmCrashNote *c = _elm_crash_ring.note + n % ELM_CRASH_RING;
+        c->file = file;
+        c->func = func;
+        c->fmt = fmt;
+        c->line = line;
+        c->level = level;
+        _elm_crash_ring.n = n + 1;
+}
+
+/* Every Logger begins with a LogGate, so that log_enabled can be inlined. */
+typedef struct {
+        int threshold;
+} LogGate;
+
+static inline int log_enabled(Logger *lg, int level)
+{
+        return level >= ((const LogGate*)lg)->threshold;
+}
+
+/*
+  A code path that goes wrong in a loop can flood a log.  To guard against
+  this, each call site of
+
+        LOG_RATE_F(L, N, fmt, ...)
+        LOG_RATE_AT(LVL, L, N, fmt, ...)
+
+  logs at most N messages per second (in bursts of up to N).  It otherwise
+  acts like LOG_F or LOG_AT; but messages over the rate are dropped, and the
+  number dropped is reported as "<count> messages suppressed" (through the same
+  logger) just before the next message that site does log, or when the logger
+  is flushed or destroyed, whichever comes first.  N must be at least one.
+
+  A site has one bucket and one count, whichever logger it is given.  Counts
+  are reported only to the logger they were counted for: if a site suppresses
+  or logs a message for another logger first, the pending count is dropped.
+  So a site that switches between loggers may under-report, but never reports
+  one logger's losses on another.
+
+  The state of each site is a static LogRate, updated with atomic operations,
+  so sites in different threads never contend for a lock.  (A site takes a
+  global lock once, when it first suppresses a message, to join the list that
+  flush_logger and destroy_logger check.)  These macros use a GNU C statement
+  expression.
+*/
+typedef struct LogRate LogRate;
+struct LogRate {
+        long long tat;             // when the bucket will be full again (ns)
+        unsigned long nsuppressed; // since the last message that was logged
+
+        Logger *lg;                // the logger it last suppressed for
+        const char *file, *func;   // the site, once it is on the list
+        int line, listed;
+        LogRate *next;
+};
+
+extern int log_rate_ok(LogRate *rate, Logger *lg, unsigned long per_sec,
+                       const char *file, int line, const char *func);
+
+#define LOG_RATE_F(L, N, ...) LOG_RATE_AT(LOG_LEVEL_ALWAYS, L, N, __VA_ARGS__)
+#define LOG_RATE_AT(LVL, L, N, ...) ({                                   \
+        static LogRate _elm_log_rate;                                    \
+        (LVL) >= ELM_LOG_MIN_LEVEL && log_enabled((L), (LVL)) &&         \
+        log_rate_ok(&_elm_log_rate, (L), (N), __FILE__,__LINE__,__func__) ? \
+          log_at((L), (LVL), __FILE__, __LINE__, __func__, __VA_ARGS__) : 0; \
+})
 
 /*
    You can also log an error using log_error.  The metadata (such as the line
@@ -483,6 +875,64 @@ extern void *malloc_or_die(const char* file, int line, const char *func, size_t
 
 #define MALLOC(N) malloc_or_die(__FILE__, __LINE__, __func__, N)
 
+/*
+  When lots of objects share a lifetime (e.g. everything allocated while
+  handling one request), you can allocate them from an arena instead:
+*/
+typedef struct Arena Arena;
+extern Arena *new_arena(size_t chunk_size);
+extern void *arena_alloc_or_die(Arena *a, const char* file, int line,
+                                          const char *func, size_t n);
+#define ARENA_ALLOC(A, N) arena_alloc_or_die(A, __FILE__, __LINE__, __func__, N)
+extern void reset_arena(Arena *a);
+extern void destroy_arena(Arena *a);
+/*
+  ARENA_ALLOC() hands out suitably aligned memory by bumping a pointer
+  through chunks of (at least) `chunk_size` bytes, which it gets from
+  MALLOC().  So it never returns NULL, and it fails with the same nomem panic
+  (after calling the same rescue function).  Pass chunk_size = 0 for a default
+  of 64 KiB; larger requests get a chunk of their own.
+
+  There is no way to free a single object.  Instead reset_arena() frees
+  everything allocated from the arena at once (keeping one chunk to reuse),
+  and destroy_arena() frees everything including the arena itself.
+
+  Arenas do no locking, so each one should only be used by one thread at a
+  time; give each thread its own.  Or use
+*/
+extern Arena *thread_arena();
+/*
+  which returns an arena private to the calling thread.  It is created on first
+  use and destroyed when the thread exits.
+
+
+  Objects of one size which are allocated and freed at a high rate can be
+  recycled through a pool:
+*/
+typedef struct Pool Pool;
+extern Pool *new_pool(size_t size, size_t nkeep);
+extern void *pool_get_or_die(Pool *pl, const char* file, int line,
+                                       const char *func);
+#define POOL_GET(P) pool_get_or_die(P, __FILE__, __LINE__, __func__)
+#define POOL_OF(T, NKEEP) new_pool(sizeof(T), NKEEP)
+extern void pool_put(Pool *pl, void *obj);
+extern void destroy_pool(Pool *pl);
+/*
+  POOL_GET() returns an object of `size` bytes, taking it from the calling
+  thread's list of free objects if it can (a hit), and from MALLOC() otherwise
+  (a miss).  So it never returns NULL and fails with the usual nomem panic.
+  pool_put() adds an object to the calling thread's free list, unless the list
+  already holds `nkeep` objects (0 means no limit), in which case it is
+  free()d.  Any thread may put() objects which another thread got.
+
+  A thread's free objects are free()d when it exits, and destroy_pool() frees
+  those of all threads.  It does not free objects which were never put back,
+  those can still be passed to free().
+
+  To help choose nkeep, you can count the hits and misses (for all threads):
+*/
+extern void pool_stats(Pool *pl, size_t *nhits, size_t *nmisses);
+
 
 
 
@@ -0,0 +1,48 @@
+/*----------------------------------------------------------------------------
+  elm_decode.c: turns binary logs back into text.
+
+  Usage: elm-decode [-t] [FILE ...]
+
+  Decodes each FILE (or standard input) written by a binary logger (see
+  new_logger in elm.h) to standard output.  With -t, each line is preceded by
+  its timestamp.
+
+  Copyright (C) 2012, Adrian Ratnapala, under the ISC license. See file LICENSE.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "elm.h"
+
+static void decode_file(const char *zname, const char *opts)
+{
+        FILE *in = zname ? fopen(zname, "rb") : stdin;
+        if(!in)
+                IO_PANIC(zname, errno, "opening binary log");
+
+        Error *err = log_decode(in, stdout, opts);
+        if(zname)
+                fclose(in);
+        panic_if(err);
+}
+
+int main(int argc, const char **argv)
+{
+        const char *opts = "";
+        int k = 1;
+
+        if(k < argc && !strcmp(argv[k], "-t")) {
+                opts = "t";
+                k++;
+        }
+
+        if(k == argc)
+                decode_file(NULL, opts);
+        for(; k < argc; k++)
+                decode_file(argv[k], opts);
+
+        return 0;
+}
@@ -7,6 +7,17 @@
   when and "how" they are supposed to, even if the "how" means the error
   propagates all the way to the top level of the program.
 
+  The tests a program should run are those it lists in the result stream of
+  0unit's zunit_main().  For programs that don't use zunit_main(), they are
+  found by scanning the source for test functions instead.
+
+  Independent test programs (or runs of one program with different arguments)
+  can be run concurrently with run_parallel(), on as many workers as there are
+  CPUs, or $N0RUN_JOBS if that is set.
+
+  The results of benchmarks written with 0unit's BENCH() are collected too,
+  and appended to the file $N0RUN_BENCH (if set) as JSON lines.
+
   Copyright (C) 2012, Adrian Ratnapala, under the ISC license. See file LICENSE.
 """
 
@@ -58,16 +69,66 @@ def Maker(base=object) : # turns a function into a class with only a constructor
 
 @Maker()
 def RunData(s, command, source) :
+        """
+        Runs a test program, keeping its output and exit status, and the
+        result stream that 0unit's zunit_main() writes to $ZUNIT_RESULTS.
+        """
         import os
         from subprocess import Popen, PIPE
+        from tempfile import NamedTemporaryFile
         s.command = command
         s.source = source
 
         test_dir = os.environ.get('TEST_DIR', None)
-        popen = Popen(s.command, stdout=PIPE, stderr=PIPE, cwd=test_dir)
+        with NamedTemporaryFile(prefix='n0run-') as results :
+                env = dict(os.environ, ZUNIT_RESULTS=results.name)
+                popen = Popen(s.command, stdout=PIPE, stderr=PIPE,
+                              cwd=test_dir, env=env)
+
+                s.out, s.err = popen.communicate()
+                s.errno = popen.wait()
+                s.results = [ l.split(b'\t') for l in results.read().splitlines() ]
+
+def registered_tests(results) :
+        "The names of the tests listed in a 0unit result stream."
+        return { r[1].decode('utf-8') for r in results if r[0] == b'test' }
+
+def jobs() :
+        import os
+        return int(os.environ.get('N0RUN_JOBS', 0)) or os.cpu_count() or 1
+
+def run_parallel(makers, njobs = None) :
+        """
+        Calls each of /makers/ (functions that construct, and so run, a Runner)
+        on a pool of /njobs/ worker threads, and returns the runners in the
+        same order as /makers/.  Since nothing is scanned until all have run,
+        the results (and the output of their scans) do not depend on which
+        finished first.
+
+        The wall-clock time is reported on stdout, with the CPU time used by
+        the test programs.  Running them one by one would have taken at least
+        that CPU time, so the difference is a lower bound on the time saved.
+        (The sum of the runs' own wall-clock times is no good for this, since
+        runs sharing a CPU slow each other down.)
+        """
+        from concurrent.futures import ThreadPoolExecutor
+        from resource import getrusage, RUSAGE_CHILDREN
+        from time import monotonic
+
+        def cpu() :
+                ru = getrusage(RUSAGE_CHILDREN)
+                return ru.ru_utime + ru.ru_stime
 
-        s.out, s.err = popen.communicate()
-        s.errno = popen.wait()
+        njobs = njobs or jobs()
+        t0, cpu0 = monotonic(), cpu()
+        with ThreadPoolExecutor(max_workers = njobs) as pool :
+                runners = list(pool.map(lambda mk : mk(), makers))
+        wall, used = monotonic() - t0, cpu() - cpu0
+
+        print("n0run: {} runs on {} workers in {:.2f}s, using {:.2f}s of CPU "
+              "(at least {:.2f}s saved)".format(len(runners), njobs, wall,
+              used, max(0, used - wall)))
+        return runners
 
 # source -----------------------------------------------------
 def scan_source(filename, def_re = None, cb = (lambda l,m : None) ) :
@@ -131,6 +192,9 @@ def compile_matchers(sources) :
 match_passed = compile_matchers([ ('passed', b'^passed: (?P<n>test\S*)'), ])
 match_failed = compile_matchers([ ('FAILED', b'^FAILED: [^:]+:[0-9]+:(?P<n>test\S*)') ])
 match_allpassed = compile_matchers([ (None, b'^All [0-9]+ tests passed$')])
+match_somefailed = compile_matchers([ (None, b'^[0-9]+ of [0-9]+ tests FAILED\.$')])
+match_note = compile_matchers([ (None, b'^note: test\S*: ')])
+match_bench = compile_matchers([ (None, b'^bench: test\S*: ')])
 
 
 def scan_output(po, matchers = match_passed ) :
@@ -162,10 +226,43 @@ def scan_output(po, matchers = match_passed ) :
 
         return out, err
 
+# benchmarks -------------------------------------------------
+
+def benchmarks(lines) :
+        """
+        The results of 0unit's BENCH() found in a test program's output, as
+        dicts with the same keys as the JSON lines of elm-bench (plus 'test').
+        """
+        from re import compile
+        bench_re = compile(br'^bench: (?P<test>test\S*): (?P<bench>.*): '
+                           br'(?P<ns_op>[0-9.]+) ns/op, min (?P<min>[0-9.]+), '
+                           br'median (?P<p50>[0-9.]+), p99 (?P<p99>[0-9.]+), '
+                           br'n (?P<n>[0-9]+)$')
+        for line in lines_without_ansi(lines) :
+                m = bench_re.match(line)
+                if not m : continue
+                b = { k : v.decode('utf-8') for k, v in m.groupdict().items() }
+                b['n'] = int(b['n'])
+                for k in ('ns_op', 'min', 'p50', 'p99') :
+                        b[k] = float(b[k])
+                yield b
+
+def save_benchmarks(runner, path = None) :
+        """
+        Appends the benchmarks a runner's program reported to /path/ (or to
+        $N0RUN_BENCH, if that is set) as one JSON object per line.
+        """
+        import json, os
+        path = path or os.environ.get('N0RUN_BENCH')
+        if not path : return
+        with open(path, 'a') as f :
+                for b in benchmarks(runner.lines) :
+                        f.write(json.dumps(b) + '\n')
+
 # runner -----------------------------------------------------
 
 class Runner :
-        matchers = match_passed + match_allpassed
+        matchers = match_passed + match_allpassed + match_note + match_bench
         command_pre = ['valgrind', '-q', '--leak-check=yes']
         def __init__(s, command, source) :
                 s.data = RunData(s.command_pre + list(command), source)
@@ -173,7 +270,10 @@ class Runner :
                 s.lines = s.data.out.split(b'\n')
 
         # any one of these might be overriden
-        def scan_source(s) : return scan_source(s.data.source)
+        def scan_source(s) :
+                # programs using zunit_main() list their own tests.
+                return (registered_tests(s.data.results) or
+                        scan_source(s.data.source))
         def scan_output(s) : return scan_output(s.lines, s.matchers)
         def check_output(s):
                 if s.data.err != b'' :
@@ -186,7 +286,8 @@ class Runner :
 
 
 class Fail_Runner(Runner) :
-        matchers = match_passed + match_failed
+        matchers = (match_passed + match_failed + match_somefailed +
+                    match_note + match_bench)
         command_pre = ['valgrind', '-q']
 
         def __init__(s, command, source, xerrno=None) :
@@ -293,7 +394,9 @@ class Results() :
 
 
 if __name__ == "__main__":
-        results = run_main_argv()
+        runner = Runner(*parse_argv())
+        results = run_main(runner)
+        save_benchmarks(runner)
 
         results.check_found( results.run )
         results.check_run( results.src )
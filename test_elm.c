@@ -15,11 +15,19 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "0unit.h"
 #include "elm.h"
@@ -32,7 +40,7 @@
 
 // ----------------------------------------------------------------------------
 
-static int test_versions()
+TEST(test_versions)
 /* This test is fairly thin.  It
   (a) Checks that the runtime version is the same as the compile-time
       version (since test_elm is always built with elm).
@@ -98,7 +106,7 @@ static int chk_error( Error *err, const ErrorType *type,
         PASS_QUIETLY();
 }
 
-static int test_errors()
+TEST(test_errors)
 {
         int pre_line = __LINE__;
         Error *e = ERROR("goodbye world!");
@@ -112,7 +120,7 @@ static int test_errors()
         PASS();
 }
 
-static int test_error_format()
+TEST(test_error_format)
 {
         int pre_line = __LINE__;
         Error *e[] = {
@@ -135,7 +143,7 @@ static int test_error_format()
         PASS();
 }
 
-static int test_simple_custom_error()
+TEST(test_simple_custom_error)
 {
         ErrorType _sc_error_type = {0},
                   *sc_error_type = &_sc_error_type;
@@ -147,7 +155,7 @@ static int test_simple_custom_error()
         PASS();
 }
 
-static int test_keep_first_error()
+TEST(test_keep_first_error)
 {
         Error *e1, *e2;
         CHK(NULL == keep_first_error(NULL, NULL));
@@ -163,7 +171,71 @@ static int test_keep_first_error()
         PASS();
 }
 
-static int test_system_error()
+static void *destroy_error_thread(void *e)
+{
+        destroy_error(e);
+        return NULL;
+}
+
+TEST(test_error_reuse)
+{
+        Error *e = ERROR("short %s", "message");
+        destroy_error(e);
+        CHK(e == ERROR("%s", "another"));
+        CHK(chk_error(e, error_type, "another"));
+        destroy_error(e);
+
+        // long messages do not fit inside the error.
+        char zlong[1024];
+        memset(zlong, 'x', sizeof zlong - 1);
+        zlong[sizeof zlong - 1] = 0;
+        e = ERROR("%s!", zlong);
+        CHK(strlen(e->data) == sizeof zlong);
+        destroy_error(e);
+
+        // errors can be destroyed by a different thread.
+        pthread_t th;
+        e = ERROR("thread %d", 2);
+        CHK(!pthread_create(&th, NULL, destroy_error_thread, e));
+        CHK(!pthread_join(th, NULL));
+
+        PASS();
+}
+
+TEST(test_lazy_error)
+{
+        char ztoken[] = "brillig";
+        Error *e[] = {
+                LAZY_ERROR("Unexpected %s on line %d.", ztoken, 7),
+                LAZY_ERROR("%-*s|%.*f|%lld|%zu|%c|%%", 5, "ab", 2, 0.125,
+                           -1LL << 40, (size_t)3, 'x'),
+                LAZY_ERROR("%.3s %s", ztoken, "toves"),
+                LAZY_ERROR("%2$s %1$s", "world", "hello"),
+        };
+        // arguments are captured by value.
+        strcpy(ztoken, "slithy");
+
+        CHK(chk_error(e[0], lazy_error_type, "Unexpected brillig on line 7."));
+        CHK(chk_error(e[1], lazy_error_type,
+                      "ab   |0.12|-1099511627776|3|x|%"));
+        CHK(chk_error(e[2], lazy_error_type, "bri toves"));
+        CHK(chk_error(e[3], lazy_error_type, "hello world"));
+        CHK(!strcmp(e[0]->meta.func, __func__));
+        for(int k = 0; k < 4; k++)
+                destroy_error(e[k]);
+
+        // long arguments do not fit inside the error.
+        char zlong[1024];
+        memset(zlong, 'x', sizeof zlong - 1);
+        zlong[sizeof zlong - 1] = 0;
+        Error *e_long = LAZY_ERROR("%s", zlong);
+        CHK(chk_error(e_long, lazy_error_type, zlong));
+        destroy_error(e_long);
+
+        PASS();
+}
+
+TEST(test_system_error)
 {
         char *xerror;
         PanicReturn ret;
@@ -205,7 +277,7 @@ static int test_system_error()
         PASS();
 }
 
-static int test_variadic_system_error()
+TEST(test_variadic_system_error)
 {
         char *xerror;
 
@@ -225,7 +297,7 @@ static int test_variadic_system_error()
         PASS();
 }
 
-static int test_unpack_system_error()
+TEST(test_unpack_system_error)
 {
         void *UNTOUCHED_PTR = (void*)0xfafafaf;
         Error *e = NULL;
@@ -287,7 +359,7 @@ static int test_unpack_system_error()
 
 // ----------------------------------------------------------------------------
 
-static int test_logging()
+TEST(test_logging)
 {
         static const char *expected_text =
                 "TEST: Hello Logs!\n"
@@ -339,7 +411,7 @@ static int test_logging()
 }
 
 
-static int test_logger_refcounts()
+TEST(test_logger_refcounts)
 {
         static const char *expected_text =
                 "TEST: Logging with two refs.\n"
@@ -373,7 +445,7 @@ static int test_logger_refcounts()
         PASS();
 }
 
-static int test_static_logger_refcounts()
+TEST(test_static_logger_refcounts)
 {
         CHK(NULL == destroy_logger(null_log));
         CHK(NULL == destroy_logger(dbg_log));
@@ -398,7 +470,7 @@ static int test_static_logger_refcounts()
         PASS();
 }
 
-static int test_debug_logger()
+TEST(test_debug_logger)
 {
         size_t size;
         char *buf, *expect;
@@ -427,6 +499,871 @@ static int test_debug_logger()
         PASS();
 }
 
+static int chk_stamped_prefixes(long tid)
+{
+        size_t size = 0;
+        char *buf;
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("STEST", mstream, "Ti");
+        LOG_F(lg, "one");
+        Logger *dlg = new_logger("DTEST", mstream, "dT");
+        int line_p = __LINE__;
+        LOG_F(dlg, "two");
+        destroy_logger(dlg);
+        destroy_logger(lg);
+        fclose(mstream);
+
+        int year, mon, day, hour, min, sec, ms, nrest = 0;
+        long ltid;
+        char *line = buf;
+        CHK(sscanf(line, "%4d-%2d-%2dT%2d:%2d:%2d.%3dZ [%ld] STEST: one\n%n",
+                   &year, &mon, &day, &hour, &min, &sec, &ms, &ltid,
+                   &nrest) == 8);
+        CHK(nrest > 0 && ltid == tid);
+        CHK(year >= 2012 && mon >= 1 && mon <= 12 && ms < 1000);
+
+        char *expect;
+        line += nrest;
+        CHK(asprintf(&expect, "DTEST (%s:%d in %s): two\n",
+                     __FILE__, line_p + 1, __func__) > 0);
+        CHK(strlen(line) == 25 + strlen(expect));
+        CHK(line[23] == 'Z' && !strcmp(line + 25, expect));
+        free(expect);
+        free(buf);
+
+        PASS_QUIETLY();
+}
+
+TEST(test_log_stamps)
+{
+        struct timespec t0, t1;
+        long tid = syscall(SYS_gettid);
+
+        clock_gettime(CLOCK_REALTIME, &t0);
+        Error *e = ERROR("stamped");
+        clock_gettime(CLOCK_REALTIME, &t1);
+
+        // the clock is coarse, allow it to lag by up to a second.
+        long long ns0 = t0.tv_sec * 1000000000LL + t0.tv_nsec - 1000000000;
+        long long ns1 = t1.tv_sec * 1000000000LL + t1.tv_nsec;
+        CHK(e->meta.time_ns >= ns0 && e->meta.time_ns <= ns1);
+        CHK(e->meta.tid == tid);
+        destroy_error(e);
+
+        // a forked child stamps its own tid, not its parent's.
+        pid_t pid = fork();
+        if(!pid) {
+                e = ERROR("forked");
+                _exit(e->meta.tid != getpid());
+        }
+        int status;
+        CHK(pid > 0 && waitpid(pid, &status, 0) == pid);
+        CHK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        if(!FAKE_FAIL)
+                CHK(chk_stamped_prefixes(tid));
+        PASS();
+}
+
+static int chk_tee_logger()
+{
+        size_t size[2] = { 0 };
+        char *buf[2], zlong[600];
+        FILE *mstream[2];
+        Logger *child[3];
+
+        for(int k = 0; k < 2; k++)
+                CHK(mstream[k] = open_memstream(buf + k, size + k));
+        child[0] = new_logger("A", mstream[0], NULL);
+        child[1] = new_logger("B", mstream[1], NULL);
+        child[2] = null_log;
+        set_log_level(child[0], LOG_LEVEL_WARN);
+
+        // the tee keeps its own references
+        Logger *tee = new_tee_logger(child, 3);
+        destroy_logger(child[0]);
+        destroy_logger(child[1]);
+
+        CHK(LOG_INFO_F(tee, "info %d", 1) == 10);
+        CHK(LOG_WARN_F(tee, "warn") == 16);
+
+        memset(zlong, 'x', sizeof zlong - 1);
+        zlong[sizeof zlong - 1] = 0;
+        CHK(LOG_F(tee, "%s", zlong) == 2 * (3 + sizeof zlong));
+
+        Error *err = ERROR("bad %s", "thing");
+        CHK(log_error(tee, err) == 2 * 13);
+        destroy_error(err);
+
+        CHK(set_log_level(tee, LOG_LEVEL_ERROR) == LOG_LEVEL_DEBUG);
+        CHK(LOG_WARN_F(tee, "warn") == 0);
+        CHK(!flush_logger(tee));
+        destroy_logger(tee);
+
+        for(int k = 0; k < 2; k++)
+                fclose(mstream[k]);
+        CHK(!strncmp(buf[0], "A: warn\nA: xxx", 14));
+        CHK(!strncmp(buf[1], "B: info 1\nB: warn\nB: xxx", 24));
+        for(int k = 0; k < 2; k++) {
+                char zbad[] = "?: bad thing\n";
+                zbad[0] = "AB"[k];
+                CHK(size[k] > 13 && !strcmp(buf[k] + size[k] - 13, zbad));
+                free(buf[k]);
+        }
+
+        PASS_QUIETLY();
+}
+
+TEST(test_tee_logger)
+/* One message, formatted once, for several loggers. */
+{
+        if(!FAKE_FAIL)
+                CHK(chk_tee_logger());
+        PASS();
+}
+
+static int rate_limited_log(Logger *lg, int k)
+/* One call site, shared by every call. */
+{
+        return LOG_RATE_F(lg, 100, "message %d", k);
+}
+
+static int burst_log(Logger *lg, int k)
+{
+        return LOG_RATE_F(lg, 10, "burst %d", k);
+}
+
+static int chk_suppressed_reported()
+/* Counts pending when a site goes quiet are logged on flush and destroy. */
+{
+        size_t size = 0;
+        char *buf;
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("QTEST", mstream, NULL);
+        int nlogged = 0, nsuppressed = 0, nreports = 0;
+        for(int k = 0; k < 20; k++)
+                nlogged += burst_log(lg, k) > 0;
+        CHK(!flush_logger(lg));
+        for(int k = 20; k < 25; k++)
+                nlogged += burst_log(lg, k) > 0;
+        destroy_logger(lg);
+        fclose(mstream);
+
+        for(char *line = buf; *line; line = strchr(line, '\n') + 1) {
+                int n;
+                if(sscanf(line, "QTEST: %d messages suppressed\n", &n) == 1)
+                        nsuppressed += n, nreports++;
+        }
+        CHK(nreports == 2 && nlogged + nsuppressed == 25);
+        free(buf);
+
+        PASS_QUIETLY();
+}
+
+static int switch_log(Logger *lg, int k)
+{
+        return LOG_RATE_F(lg, 1, "switch %d", k);
+}
+
+static int chk_suppressed_per_logger()
+/* A count pending for one logger is not reported on another. */
+{
+        size_t size = 0;
+        char *buf;
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *a = new_logger("ATEST", mstream, NULL),
+               *b = new_logger("BTEST", mstream, NULL);
+        CHK(switch_log(a, 0) > 0);
+        for(int k = 1; k < 4; k++)
+                CHK(switch_log(a, k) == 0);
+        CHK(switch_log(b, 4) == 0);
+        destroy_logger(b);
+        destroy_logger(a);
+        fclose(mstream);
+
+        CHK(!strcmp(buf, "ATEST: switch 0\n"
+                         "BTEST: 1 messages suppressed\n"));
+        free(buf);
+
+        PASS_QUIETLY();
+}
+
+static int chk_rate_limited_log()
+{
+        size_t size = 0;
+        char *buf;
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("RTEST", mstream, NULL);
+        struct timespec t0, t1;
+        int nlogged = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(int k = 0; k < 150; k++)
+                nlogged += rate_limited_log(lg, k) > 0;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        // The bucket holds 100 messages, and refills at 1 per 10ms (allow a
+        // couple more for the coarse clock).
+        double ms = 1e3 * (t1.tv_sec - t0.tv_sec) +
+                    1e-6 * (t1.tv_nsec - t0.tv_nsec);
+        CHK(nlogged >= 100 && nlogged <= 102 + ms / 10);
+
+        nanosleep(&(struct timespec){ 0, 50 * 1000000 }, NULL);
+        CHK(rate_limited_log(lg, 150) > 0);
+        destroy_logger(lg);
+        fclose(mstream);
+
+        int nlines = 0, nsuppressed = 0, last = -1;
+        for(char *line = buf; *line; line = strchr(line, '\n') + 1) {
+                int n;
+                nlines++;
+                if(sscanf(line, "RTEST: %d messages suppressed\n", &n) == 1)
+                        nsuppressed = n;
+                else
+                        CHK(sscanf(line, "RTEST: message %d\n", &last) == 1);
+        }
+        CHK(nlines == nlogged + 2);
+        CHK(nsuppressed == 150 - nlogged);
+        CHK(last == 150);
+        free(buf);
+
+        PASS_QUIETLY();
+}
+
+TEST(test_log_rate)
+{
+        Logger *lg = new_logger("RTEST", NULL, NULL);
+        CHK(rate_limited_log(lg, 0) == 0); // null loggers are not rate limited.
+        destroy_logger(lg);
+
+        if(!FAKE_FAIL)
+                CHK(chk_rate_limited_log() && chk_suppressed_reported() &&
+                    chk_suppressed_per_logger());
+        PASS();
+}
+
+TEST(test_log_levels)
+{
+        size_t size = 0;
+        char *buf;
+        int nevals = 0;
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("LTEST", mstream, NULL);
+        CHK(lg);
+
+        CHK(set_log_level(lg, LOG_LEVEL_WARN) == LOG_LEVEL_DEBUG);
+        CHK(LOG_DEBUG_F(lg, "%d", ++nevals) == 0);
+        CHK(LOG_INFO_F(lg, "%d", ++nevals) == 0);
+        CHK(nevals == 0);
+        CHK(size == 0);
+
+        // null loggers don't evaluate their arguments either
+        CHK(LOG_F(null_log, "%d", ++nevals) == 0);
+        CHK(LOG_ERROR_F(null_log, "%d", ++nevals) == 0);
+        CHK(nevals == 0);
+
+        if(!FAKE_FAIL) {
+                CHK(LOG_WARN_F(lg, "%d", ++nevals) == 9);
+                CHK(LOG_ERROR_F(lg, "%d", ++nevals) == 9);
+                CHK(LOG_F(lg, "%d", ++nevals) == 9);
+                CHK(nevals == 3);
+                CHK(size == 27);
+                CHK(!memcmp(buf, "LTEST: 1\nLTEST: 2\nLTEST: 3\n", size));
+        }
+
+        CHK(set_log_level(lg, LOG_LEVEL_OFF) == LOG_LEVEL_WARN);
+        CHK(LOG_F(lg, "%d", ++nevals) == 0);
+        CHK(set_log_level(lg, LOG_LEVEL_DEBUG) == LOG_LEVEL_OFF);
+
+// Pretend we were compiled with -DELM_LOG_MIN_LEVEL=LOG_LEVEL_ERROR
+#undef ELM_LOG_MIN_LEVEL
+#define ELM_LOG_MIN_LEVEL LOG_LEVEL_ERROR
+        nevals = 0;
+        CHK(LOG_WARN_F(lg, "%d", ++nevals) == 0);
+        CHK(nevals == 0);
+        if(!FAKE_FAIL)
+                CHK(LOG_ERROR_F(lg, "%d", ++nevals) == 9);
+#undef ELM_LOG_MIN_LEVEL
+#define ELM_LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+
+        destroy_logger(lg);
+        fclose(mstream);
+        free(buf);
+
+        PASS();
+}
+
+static int chk_binary_stamps()
+/* Binary logs keep the time and tid, which a tee gives both loggers alike. */
+{
+        size_t tsize = 0, bsize = 0, dsize = 0;
+        char *tbuf, *bbuf, *dbuf;
+        FILE *tstream, *bstream, *dstream, *in;
+        Logger *child[2];
+
+        CHK(tstream = open_memstream(&tbuf, &tsize));
+        CHK(bstream = open_memstream(&bbuf, &bsize));
+        CHK(dstream = open_memstream(&dbuf, &dsize));
+        child[0] = new_logger("STAMP", tstream, "Ti");
+        child[1] = new_logger("STAMP", bstream, "TiB");
+        Logger *tee = new_tee_logger(child, 2);
+        destroy_logger(child[0]);
+        destroy_logger(child[1]);
+
+        for(int k = 0; k < 3; k++)
+                LOG_F(tee, "stamped %d", k);
+        destroy_logger(tee);
+        fclose(tstream);
+        fclose(bstream);
+
+        CHK(in = fmemopen(bbuf, bsize, "r"));
+        CHK(!log_decode(in, dstream, NULL));
+        fclose(in);
+        fclose(dstream);
+        CHK(tsize > 3 * 24 && dsize == tsize && !memcmp(dbuf, tbuf, tsize));
+
+        free(tbuf);
+        free(bbuf);
+        free(dbuf);
+        PASS_QUIETLY();
+}
+
+TEST(test_binary_logger)
+{
+        size_t tsize = 0, bsize = 0, dsize = 0;
+        char *tbuf, *bbuf, *dbuf;
+        const char *znull = NULL;
+
+        FILE *tstream = open_memstream(&tbuf, &tsize);
+        FILE *bstream = open_memstream(&bbuf, &bsize);
+        FILE *dstream = open_memstream(&dbuf, &dsize);
+        CHK(tstream && bstream && dstream);
+
+        // (with FAKE_FAIL text logging fails, so don't even try)
+        Logger *tlg = new_logger("BTEST", FAKE_FAIL ? NULL : tstream, "d");
+        Logger *blg = new_logger("BTEST", bstream, "dB");
+        CHK(tlg && blg);
+
+        // Log the same things, from the same lines, to both loggers.
+#define LOG_BOTH(...) (LOG_F(tlg, __VA_ARGS__), LOG_F(blg, __VA_ARGS__))
+        for(int k = 0; k < 3; k++) {
+                LOG_BOTH("plain text, round %d", k);
+                LOG_BOTH("%d %ld %lld %zu %u %x %c %hd", -k, 2L, 3LL,
+                         (size_t)4, 5u, 0xab, 'z', (short)7);
+                LOG_BOTH("%5.2f|%Lg|%e|%g", 3.14159, 2.5L, 1e-9, 0.1);
+                LOG_BOTH("%s|%.3s|%-6s|%*d|%-*d|%.*s|%.*s", "str", "abcdef",
+                         "left", 5, 42, 4, 7, 2, "xyz", -1, "all");
+                LOG_BOTH("%s and 100%%", znull);
+                LOG_BOTH("%p", (void*)tlg);
+                errno = ENOENT;
+                LOG_BOTH("eager %m");
+                LOG_BOTH("eager %2$s %1$s", "world", "hello");
+        }
+#undef LOG_BOTH
+        Error *e = ERROR("goodbye world!");
+        log_error(tlg, e);
+        log_error(blg, e);
+        destroy_error(e);
+
+        destroy_logger(tlg);
+        destroy_logger(blg);
+        fclose(tstream);
+        fclose(bstream);
+
+        if(!FAKE_FAIL) {
+                // binary logs are smaller, even with the site records.
+                CHK(bsize < tsize);
+
+                FILE *in = fmemopen(bbuf, bsize, "r");
+                CHK(in);
+                CHK(!log_decode(in, dstream, NULL));
+                fclose(in);
+                fflush(dstream);
+                CHK(dsize == tsize);
+                CHK(!memcmp(dbuf, tbuf, tsize));
+
+                // a truncated log is an error
+                CHK(in = fmemopen(bbuf, bsize - 1, "r"));
+                e = log_decode(in, dstream, NULL);
+                CHK(e && e->type == error_type);
+                destroy_error(e);
+                fclose(in);
+
+                CHK(chk_binary_stamps());
+        }
+
+        fclose(dstream);
+        free(tbuf);
+        free(bbuf);
+        free(dbuf);
+
+        PASS();
+}
+
+static int chk_death_flushes()
+/* An uncaught panic flushes lazy loggers, here an asynchronous one, before
+   the process exits. */
+{
+        int pfd[2], status;
+        char zout[64] = "";
+
+        CHK(!pipe(pfd));
+        fflush(NULL);
+        pid_t pid = fork();
+        if(!pid) {
+                close(pfd[0]);
+                FILE *null = fopen("/dev/null", "w");
+                if(null)
+                        dup2(fileno(null), 2);
+                Logger *lg = new_logger("DTEST", fdopen(pfd[1], "w"), "a");
+                LOG_F(lg, "last words");
+                PANIC("dying");
+        }
+        close(pfd[1]);
+        CHK(pid > 0);
+        for(size_t n = 0, nr; n < sizeof zout - 1 &&
+            (nr = read(pfd[0], zout + n, sizeof zout - 1 - n)) > 0; n += nr)
+                ;
+        close(pfd[0]);
+        CHK(waitpid(pid, &status, 0) == pid);
+        CHK(WIFEXITED(status) && WEXITSTATUS(status) == 255);
+        CHK(!strcmp(zout, "DTEST: last words\n"));
+        PASS_QUIETLY();
+}
+
+TEST(test_flush_policy)
+{
+        size_t size = 0;
+        char *buf;
+        PanicReturn ret;
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        // a memstream's size is only updated when it is flushed.
+        Logger *lg = new_logger("FTEST", mstream, "l3");
+        CHK(lg);
+
+        if(!FAKE_FAIL) {
+                CHK(LOG_F(lg, "one") == 11);
+                CHK(LOG_F(lg, "two") == 11);
+                CHK(size == 0);
+                CHK(LOG_F(lg, "six") == 11);
+                CHK(size == 33);
+
+                logger_flush_policy(lg, LOG_FLUSH_BYTES, 20);
+                LOG_F(lg, "a");
+                LOG_F(lg, "b");
+                CHK(size == 33);
+                LOG_F(lg, "c");
+                CHK(size == 33 + 27);
+
+                logger_flush_policy(lg, LOG_FLUSH_ERRORS, 0);
+                LOG_F(lg, "d");
+                CHK(size == 33 + 27);
+                Error *e = ERROR("e");
+                log_error(lg, e);
+                destroy_error(e);
+                CHK(size == 33 + 27 + 18);
+
+                logger_flush_policy(lg, LOG_FLUSH_INTERVAL, 1000000);
+                LOG_F(lg, "f");
+                CHK(size == 33 + 27 + 18);
+                CHK(!flush_logger(lg));
+                CHK(size == 33 + 27 + 27);
+
+                // a caught panic does not flush,
+                LOG_F(lg, "g");
+                if(ret.error = TRY(ret)) {
+                        destroy_error(ret.error);
+                } else {
+                        PANIC("oops");
+                        NO_WORRIES(ret);
+                }
+                CHK(size == 33 + 27 + 27);
+
+                // but an uncaught one does, and so does destroy_logger.
+                CHK(chk_death_flushes());
+                LOG_F(lg, "h");
+                CHK(size == 33 + 27 + 27);
+        }
+
+        destroy_logger(lg);
+        if(!FAKE_FAIL)
+                CHK(size == 33 + 27 + 45);
+
+        fclose(mstream);
+        free(buf);
+
+        PASS();
+}
+
+#define ASYNC_NTHREADS  4
+#define ASYNC_NMESSAGES 2000
+
+static void *async_log_thread(void *lg)
+{
+        for(int k = 0; k < ASYNC_NMESSAGES; k++)
+                LOG_F(lg, "message %d", k);
+        return NULL;
+}
+
+static int count_lines(const char *buf, size_t size, const char *start)
+{
+        int n = 0, len = strlen(start);
+        for(const char *line = buf; line < buf + size;
+                        line = strchr(line, '\n') + 1)
+                n += !strncmp(line, start, len);
+        return n;
+}
+
+TEST(test_async_logger)
+{
+        size_t size;
+        char *buf;
+        pthread_t threads[ASYNC_NTHREADS];
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("ATEST", mstream, "a");
+        CHK(lg);
+
+        for(int k = 0; k < ASYNC_NTHREADS; k++)
+                CHK(!pthread_create(threads + k, NULL, async_log_thread, lg));
+        for(int k = 0; k < ASYNC_NTHREADS; k++)
+                CHK(!pthread_join(threads[k], NULL));
+
+        CHK(!flush_logger(lg));
+        CHK(logger_ndropped(lg) == 0);
+        CHK(size && buf[size - 1] == '\n');
+        CHK(count_lines(buf, size, "ATEST: message ") ==
+                        ASYNC_NTHREADS * ASYNC_NMESSAGES);
+        CHK(count_lines(buf, size, "") == ASYNC_NTHREADS * ASYNC_NMESSAGES);
+
+        size_t old_size = size;
+        CHK(LOG_F(lg, "last") == 12);
+        destroy_logger(lg);
+        CHK(size == old_size + 12);
+        CHK(!memcmp(buf + old_size, "ATEST: last\n", 12));
+
+        fclose(mstream);
+        free(buf);
+
+        PASS();
+}
+
+TEST(test_async_logger_drops)
+{
+        size_t size;
+        char *buf;
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("DROP", mstream, "A");
+        CHK(lg);
+
+        for(int k = 0; k < 4 * ASYNC_NMESSAGES; k++)
+                LOG_F(lg, "message %d", k);
+        CHK(!flush_logger(lg));
+        size_t ndropped = logger_ndropped(lg);
+        destroy_logger(lg);
+
+        int nkept = count_lines(buf, size, "DROP: message ");
+        CHK(nkept + ndropped == 4 * ASYNC_NMESSAGES);
+
+        size_t nreported = 0;
+        for(const char *line = buf; line < buf + size;
+                        line = strchr(line, '\n') + 1) {
+                size_t n;
+                if(sscanf(line, "DROP: %zu messages dropped", &n) == 1)
+                        nreported += n;
+        }
+        CHK(nreported == ndropped);
+
+        fclose(mstream);
+        free(buf);
+
+        PASS();
+}
+
+static int chk_whole_lines()
+{
+        size_t size;
+        char *buf, zlong[1000];
+        pthread_t threads[ASYNC_NTHREADS];
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("WTEST", mstream, "");
+        for(int k = 0; k < ASYNC_NTHREADS; k++)
+                CHK(!pthread_create(threads + k, NULL, async_log_thread, lg));
+        for(int k = 0; k < ASYNC_NTHREADS; k++)
+                CHK(!pthread_join(threads[k], NULL));
+
+        // too long for the stack buffer
+        memset(zlong, 'x', sizeof zlong - 1);
+        zlong[sizeof zlong - 1] = 0;
+        CHK(LOG_F(lg, "%s", zlong) == 7 + sizeof zlong);
+        destroy_logger(lg);
+        fclose(mstream);
+
+        CHK(count_lines(buf, size, "WTEST: message ") ==
+                        ASYNC_NTHREADS * ASYNC_NMESSAGES);
+        CHK(count_lines(buf, size, "") == ASYNC_NTHREADS * ASYNC_NMESSAGES + 1);
+        CHK(!memcmp(buf + size - sizeof zlong, zlong, sizeof zlong - 1));
+        CHK(buf[size - 1] == '\n');
+        free(buf);
+
+        PASS_QUIETLY();
+}
+
+TEST(test_whole_lines)
+/* Plain loggers shared by threads write each line in one piece. */
+{
+        if(!FAKE_FAIL)
+                CHK(chk_whole_lines());
+        PASS();
+}
+
+#define SHARED_NTHREADS 16
+
+static void *shared_log_thread(void *lg)
+/* Uses, then drops, a reference taken by the spawning thread. */
+{
+        for(int k = 0; k < ASYNC_NMESSAGES / 10; k++) {
+                Logger *refs[] = { ref_logger(lg), ref_logger(std_log),
+                                   ref_logger(null_log) };
+                LOG_F(refs[0], "message %d", k);
+                LOG_F(refs[2], "message %d", k);
+                for(int j = 0; j < 3; j++)
+                        destroy_logger(refs[j]);
+        }
+        destroy_logger(lg);
+        return NULL;
+}
+
+TEST(test_shared_loggers)
+{
+        size_t size;
+        char *buf;
+        pthread_t threads[SHARED_NTHREADS];
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        // the last thread to finish destroys the logger.
+        Logger *lg = new_logger("STEST", mstream, "a");
+        for(int k = 0; k < SHARED_NTHREADS; k++)
+                CHK(!pthread_create(threads + k, NULL, shared_log_thread,
+                                    ref_logger(lg)));
+        destroy_logger(lg);
+        for(int k = 0; k < SHARED_NTHREADS; k++)
+                CHK(!pthread_join(threads[k], NULL));
+
+        fclose(mstream);
+        CHK(count_lines(buf, size, "STEST: message ") ==
+                        SHARED_NTHREADS * (ASYNC_NMESSAGES / 10));
+        free(buf);
+
+        PASS();
+}
+
+static char *read_file(const char *path, size_t *size)
+/* The whole contents of a file, or NULL if it can't be read. */
+{
+        FILE *f = fopen(path, "rb");
+        if(!f)
+                return NULL;
+
+        fseek(f, 0, SEEK_END);
+        *size = ftell(f);
+        rewind(f);
+        char *buf = malloc(*size + 1);
+        if(buf && fread(buf, 1, *size, f) == *size)
+                buf[*size] = 0;
+        else {
+                free(buf);
+                buf = NULL;
+        }
+        fclose(f);
+        return buf;
+}
+
+TEST(test_file_loggers)
+{
+        char zdir[] = "/tmp/elm-test-XXXXXX", zpath[64], zseg[80];
+        pthread_t threads[ASYNC_NTHREADS];
+        size_t size;
+        char *buf;
+
+        CHK(mkdtemp(zdir));
+        snprintf(zpath, sizeof zpath, "%s/log", zdir);
+
+        // fill many small segments from several threads.
+        Logger *lg = new_file_logger("MTEST", zpath, "m4096");
+        for(int k = 0; k < ASYNC_NTHREADS; k++)
+                CHK(!pthread_create(threads + k, NULL, async_log_thread, lg));
+        for(int k = 0; k < ASYNC_NTHREADS; k++)
+                CHK(!pthread_join(threads[k], NULL));
+        destroy_logger(lg);
+
+        // reopening appends.
+        lg = new_file_logger("MTEST", zpath, "m4096");
+        LOG_F(lg, "last");
+        destroy_logger(lg);
+
+        int nlines = 0, nsegs;
+        for(nsegs = 0; ; nsegs++) {
+                snprintf(zseg, sizeof zseg, "%s.%d", zpath, nsegs + 1);
+                if(!(buf = read_file(zseg, &size)))
+                        break;
+                CHK(size > 0 && size <= 4096 && buf[size - 1] == '\n');
+                CHK(strlen(buf) == size);
+                nlines += count_lines(buf, size, "MTEST: message ");
+                free(buf);
+                CHK(!remove(zseg));
+        }
+        CHK(nsegs > 10);
+
+        CHK(buf = read_file(zpath, &size));
+        CHK(strlen(buf) == size);
+        nlines += count_lines(buf, size, "MTEST: message ");
+        CHK(size > 12 && !strcmp(buf + size - 12, "MTEST: last\n"));
+        CHK(nlines == ASYNC_NTHREADS * ASYNC_NMESSAGES);
+        free(buf);
+        CHK(!remove(zpath));
+
+        // without 'm', the file is an ordinary stream.
+        if(!FAKE_FAIL) {
+                lg = new_file_logger("FTEST", zpath, NULL);
+                LOG_F(lg, "plain");
+                destroy_logger(lg);
+                CHK(buf = read_file(zpath, &size));
+                CHK(!strcmp(buf, "FTEST: plain\n"));
+                free(buf);
+                CHK(!remove(zpath));
+        }
+
+        // a logger that fails to start closes its file.
+        int fd = dup(2);
+        CHK(fd >= 0 && !close(fd));
+        PanicReturn ret;
+        Error *err;
+        if(!(err = TRY(ret))) {
+                lg = new_file_logger("BTEST", "/dev/full", "B");
+                NO_WORRIES(ret);
+                destroy_logger(lg);
+        }
+        CHK(err);
+        destroy_error(err);
+        CHK(dup(2) == fd && !close(fd));
+
+        CHK(!rmdir(zdir));
+        PASS();
+}
+
+static int rotated_lines(const char *zdir, const char *prefix,
+                         int *nfiles, int *ngz)
+/* Count lines in (and then remove) the files in zdir, gunzipping as needed. */
+{
+        char zpath[512], zcmd[sizeof zpath + 16];
+        struct dirent *d;
+        int nlines = 0;
+        size_t size;
+        char *buf;
+
+        DIR *dir = opendir(zdir);
+        if(!dir)
+                return -1;
+        *nfiles = *ngz = 0;
+        while((d = readdir(dir))) {
+                if(d->d_name[0] == '.')
+                        continue;
+                snprintf(zpath, sizeof zpath, "%s/%s", zdir, d->d_name);
+                size_t len = strlen(zpath);
+                if(len > 3 && !strcmp(zpath + len - 3, ".gz")) {
+                        snprintf(zcmd, sizeof zcmd, "gzip -dc '%s'", zpath);
+                        FILE *pipe = popen(zcmd, "r"), *mem;
+                        buf = NULL;
+                        if(pipe && (mem = open_memstream(&buf, &size))) {
+                                int ch;
+                                while((ch = getc(pipe)) != EOF)
+                                        putc(ch, mem);
+                                fclose(mem);
+                        }
+                        if(pipe)
+                                pclose(pipe);
+                        ++*ngz;
+                } else
+                        buf = read_file(zpath, &size);
+                if(buf)
+                        nlines += count_lines(buf, size, prefix);
+                free(buf);
+                remove(zpath);
+                ++*nfiles;
+        }
+        closedir(dir);
+        return nlines;
+}
+
+TEST(test_rotating_logger)
+{
+        char zdir[] = "/tmp/elm-test-XXXXXX", zpattern[64];
+        pthread_t threads[ASYNC_NTHREADS];
+        int nfiles, ngz;
+
+        CHK(mkdtemp(zdir));
+        snprintf(zpattern, sizeof zpattern, "%s/log-%%Y%%m%%d", zdir);
+
+        if(!FAKE_FAIL) {
+                // rotate by size, from several threads.
+                Logger *lg = new_file_logger("RTEST", zpattern, "r4096");
+                for(int k = 0; k < ASYNC_NTHREADS; k++)
+                        CHK(!pthread_create(threads + k, NULL,
+                                            async_log_thread, lg));
+                for(int k = 0; k < ASYNC_NTHREADS; k++)
+                        CHK(!pthread_join(threads[k], NULL));
+                destroy_logger(lg);
+
+                CHK(rotated_lines(zdir, "RTEST: message ", &nfiles, &ngz) ==
+                    ASYNC_NTHREADS * ASYNC_NMESSAGES);
+                CHK(nfiles > 10 && ngz == 0);
+
+                // closed files get compressed, and no name is reused once
+                // its file was gzipped away.
+                lg = new_file_logger("ZTEST", zpattern, "r1000z");
+                async_log_thread(lg);
+                destroy_logger(lg);
+                CHK(rotated_lines(zdir, "ZTEST: message ", &nfiles, &ngz) ==
+                    ASYNC_NMESSAGES);
+                CHK(nfiles > 4 && ngz == nfiles - 1);
+
+                // rotate by time.
+                lg = new_file_logger("TTEST", zpattern, "R20");
+                LOG_F(lg, "message before");
+                nanosleep(&(struct timespec){ .tv_nsec = 30000000 }, NULL);
+                LOG_F(lg, "message after");
+                destroy_logger(lg);
+                CHK(rotated_lines(zdir, "TTEST: message ", &nfiles, &ngz) == 2);
+                CHK(nfiles == 2);
+        }
+
+        CHK(!rmdir(zdir));
+        PASS();
+}
+
 // ----------------------------------------------------------------------------
 
 static int test_malloc(int n)
@@ -481,7 +1418,7 @@ static int teardown_rlimit(const struct rlimit *old_lim)
         return setrlimit(RLIMIT_AS, old_lim);
 }
 
-static int test_bad_malloc(void)
+TEST(test_bad_malloc)
 {
         const struct rlimit *old_lim;
         struct rlimit new_lim;
@@ -503,6 +1440,166 @@ static int test_bad_malloc(void)
         PASS();
 }
 
+TEST(test_arena)
+{
+        Arena *a = new_arena(1024);
+        char *first = NULL;
+
+        for(int round = 0; round < 2; round++) {
+                char *objs[100];
+                for(int k = 0; k < 100; k++) {
+                        objs[k] = ARENA_ALLOC(a, 1 + k % 37);
+                        CHK(objs[k]);
+                        CHK((uintptr_t)objs[k] % sizeof(long double) == 0);
+                        memset(objs[k], k, 1 + k % 37);
+                }
+                for(int k = 0; k < 100; k++)
+                        for(int j = 0; j < 1 + k % 37; j++)
+                                CHK(objs[k][j] == k);
+
+                // bigger than a chunk
+                char *big = ARENA_ALLOC(a, 4096);
+                memset(big, 0xff, 4096);
+                CHK(objs[99][0] == 99);
+
+                // after a reset, the same memory is used again
+                CHK(!first || first == objs[0]);
+                first = objs[0];
+                reset_arena(a);
+        }
+        destroy_arena(a);
+        destroy_arena(NULL);
+
+        // thread_arena() is created on demand, then stays put.
+        a = thread_arena();
+        CHK(a && a == thread_arena());
+        CHK(ARENA_ALLOC(a, 10));
+        reset_arena(a);
+
+        PASS();
+}
+
+TEST(test_bad_arena_alloc)
+{
+        const struct rlimit *old_lim;
+        struct rlimit new_lim;
+        CHK(old_lim = setup_rlimit(128*1024*1024, &new_lim));
+
+        Arena *a = new_arena(0);
+        PanicReturn ret;
+        Error *expected_nomem = TRY(ret);
+        if(!expected_nomem) {
+                ARENA_ALLOC(a, 16);
+                ARENA_ALLOC(a, new_lim.rlim_cur);
+                CHK(!"Unreachable code reached.");
+                NO_WORRIES(ret);
+        }
+
+        CHK(expected_nomem->type == nomem_error_type);
+        destroy_error(expected_nomem);
+        destroy_arena(a);
+
+        CHK(!teardown_rlimit(old_lim));
+        PASS();
+}
+
+typedef struct { double x, y; } PoolPoint;
+
+static void *pool_thread(void *arg)
+{
+        Pool *pl = arg;
+        PoolPoint *p[4];
+        for(int k = 0; k < 4; k++)
+                p[k] = POOL_GET(pl);
+        for(int k = 0; k < 4; k++)
+                pool_put(pl, p[k]);
+        // the free list is cleaned up when the thread exits.
+        return NULL;
+}
+
+TEST(test_pool)
+{
+        Pool *pl = POOL_OF(PoolPoint, 3);
+        size_t nhits, nmisses;
+
+        PoolPoint *p[4];
+        for(int k = 0; k < 4; k++) {
+                CHK(p[k] = POOL_GET(pl));
+                *p[k] = (PoolPoint){ k, -k };
+        }
+        pool_stats(pl, &nhits, &nmisses);
+        CHK(nhits == 0 && nmisses == 4);
+
+        // only nkeep = 3 are kept, the 4th is freed.
+        for(int k = 0; k < 4; k++)
+                pool_put(pl, p[k]);
+        pool_put(pl, NULL);
+
+        // a free list is LIFO.
+        CHK(POOL_GET(pl) == p[2]);
+        CHK(POOL_GET(pl) == p[1]);
+        CHK(POOL_GET(pl) == p[0]);
+        CHK(p[3] = POOL_GET(pl));
+        pool_stats(pl, &nhits, &nmisses);
+        CHK(nhits == 3 && nmisses == 5);
+
+        // other threads have their own free lists.
+        pthread_t th;
+        CHK(!pthread_create(&th, NULL, pool_thread, pl));
+        CHK(!pthread_join(th, NULL));
+        pool_stats(pl, &nhits, &nmisses);
+        CHK(nhits == 3 && nmisses == 9);
+
+        pool_put(pl, p[0]);
+        pool_put(pl, p[1]);
+        destroy_pool(pl);
+
+        // objects that were never put back are ordinary heap memory.
+        free(p[2]);
+        free(p[3]);
+
+        // a new pool may reuse a dead one's slot, but never its free list.
+        pl = POOL_OF(PoolPoint, 3);
+        CHK(p[0] = POOL_GET(pl));
+        pool_stats(pl, &nhits, &nmisses);
+        CHK(nhits == 0 && nmisses == 1);
+        free(p[0]);
+        destroy_pool(pl);
+
+        // pools don't use up pthread keys (of which there are only 1024).
+        static Pool *many[2000];
+        for(int k = 0; k < 2000; k++) {
+                CHK(many[k] = POOL_OF(PoolPoint, 1));
+                pool_put(many[k], POOL_GET(many[k]));
+        }
+        for(int k = 0; k < 2000; k++)
+                destroy_pool(many[k]);
+        PASS();
+}
+
+TEST(test_bad_pool_get)
+{
+        const struct rlimit *old_lim;
+        struct rlimit new_lim;
+        CHK(old_lim = setup_rlimit(128*1024*1024, &new_lim));
+
+        Pool *pl = new_pool(new_lim.rlim_cur, 0);
+        PanicReturn ret;
+        Error *expected_nomem = TRY(ret);
+        if(!expected_nomem) {
+                POOL_GET(pl);
+                CHK(!"Unreachable code reached.");
+                NO_WORRIES(ret);
+        }
+
+        CHK(expected_nomem->type == nomem_error_type);
+        destroy_error(expected_nomem);
+        destroy_pool(pl);
+
+        CHK(!teardown_rlimit(old_lim));
+        PASS();
+}
+
 const struct rlimit *fix_rlimit;
 
 static int nomem_rescue()
@@ -514,7 +1611,7 @@ static int nomem_rescue()
         return 0;
 }
 
-static int test_rescued_malloc(void)
+TEST(test_rescued_malloc)
 {
         struct rlimit new_lim;
         CHK(fix_rlimit = setup_rlimit(72*1024*1024, &new_lim));
@@ -533,6 +1630,8 @@ static int test_rescued_malloc(void)
         PASS();
 }
 
+ZUNIT_NAMED(test_malloc)  // main() runs it last, as it might die
+
 static int runtests_malloc_fail(void)
 {
         struct rlimit mem_lim;
@@ -584,7 +1683,7 @@ static int chk_recursive_panic(int depth)
         PASS_QUIETLY();
 }
 
-static int test_recursive_panic()
+TEST(test_recursive_panic)
 {
         // do it twice to check the static catch_counted is handled right.
         CHK( chk_recursive_panic(0) );
@@ -592,7 +1691,22 @@ static int test_recursive_panic()
         PASS();
 }
 
-static int test_try_panic()
+TEST_DIES(test_uncaught_panic, 255)
+/* Runs in a child process, which the panic kills. */
+{
+        LOG_DEBUG_F(null_log, "about to die");
+        PANIC("The slithy toves!");
+        PASS();
+}
+
+TEST_DIES(test_uncaught_sys_panic, EACCES)
+/* Uncaught system errors exit with their errno. */
+{
+        SYS_PANIC(EACCES, "Panic");
+        PASS();
+}
+
+TEST(test_try_panic)
 {
         PanicReturn ret;
         Error *err;
@@ -627,7 +1741,166 @@ static int test_try_panic()
         PASS();
 }
 
-static int test_panic_if()
+static char unwound[32];
+
+static void record_unwind(void *ptr)
+/* Appends *(char*)ptr to `unwound`. */
+{
+        size_t n = strlen(unwound);
+        if(n + 1 < sizeof unwound) {
+                unwound[n] = *(char*)ptr;
+                unwound[n + 1] = 0;
+        }
+}
+
+TEST(test_unwind)
+{
+        PanicReturn outer, inner;
+        Error *err;
+        char *tags = "abcdefghijkl";
+
+        // handlers run LIFO, and popped ones don't run.
+        unwound[0] = 0;
+        if(err = TRY(outer)) {
+                CHK(!strcmp(unwound, "dcb"));
+                destroy_error(err);
+        } else {
+                push_unwind(record_unwind, tags + 0);
+                pop_unwind(0);
+                push_unwind(record_unwind, tags + 1);
+                push_unwind(record_unwind, tags + 2);
+                push_unwind(record_unwind, tags + 3);
+                PANIC("unwind");
+                NO_WORRIES(outer);
+        }
+        CHK(!panic_is_caught());
+
+        // each TRY runs only its own handlers.
+        unwound[0] = 0;
+        if(err = TRY(outer)) {
+                CHK(!strcmp(unwound, "cba"));
+                destroy_error(err);
+        } else {
+                push_unwind(record_unwind, tags + 0);
+                if(err = TRY(inner)) {
+                        CHK(!strcmp(unwound, "c"));
+                        push_unwind(record_unwind, tags + 1);
+                        panic(err);
+                }
+                push_unwind(record_unwind, tags + 2);
+                PANIC("unwind");
+                NO_WORRIES(inner);
+                NO_WORRIES(outer);
+        }
+
+        // popping with run = 1 calls the handler.
+        unwound[0] = 0;
+        if(err = TRY(outer)) {
+                destroy_error(err);
+                CHK(!"Caught unexpected panic.");
+        } else {
+                push_unwind(record_unwind, tags + 4);
+                pop_unwind(1);
+                NO_WORRIES(outer);
+        }
+        CHK(!strcmp(unwound, "e"));
+
+        // too many handlers.
+        unwound[0] = 0;
+        if(err = TRY(outer)) {
+                CHK(!strcmp(unwound, "ihgfedcba"));
+                destroy_error(err);
+        } else {
+                for(int k = 0; k <= ELM_MAX_UNWIND; k++)
+                        push_unwind(record_unwind, tags + k);
+                NO_WORRIES(outer);
+        }
+        CHK(!panic_is_caught());
+
+        PASS();
+}
+
+static char *read_fd(int fd)
+/* Everything readable from fd until EOF, as a string. */
+{
+        static char buf[1 << 14];
+        size_t n = 0;
+        ssize_t nr;
+        while(n < sizeof buf - 1 && (nr = read(fd, buf + n, sizeof buf - 1 - n)) > 0)
+                n += nr;
+        buf[n] = 0;
+        return buf;
+}
+
+static int die_with_ring(int pfd[2], int by_signal)
+/* In a child: log quietly, then die, sending stderr down the pipe. */
+{
+        close(pfd[0]);
+        dup2(pfd[1], 2);
+        if(by_signal)
+                install_crash_handlers();
+        LOG_WARN_F(null_log, "last words %d", 1);
+        if(by_signal)
+                abort();
+        PANIC("the end");
+        return 0;
+}
+
+TEST(test_crash_ring)
+{
+        int pfd[2], status, nevals = 0;
+        char zexpect[128];
+        char *out;
+
+        // filtered messages are noted without evaluating their arguments
+        CHK(!pipe(pfd));
+        LOG_DEBUG_F(null_log, "quiet %d", ++nevals); int line = __LINE__;
+        dump_crash_ring(pfd[1]);
+        close(pfd[1]);
+        out = read_fd(pfd[0]);
+        close(pfd[0]);
+        snprintf(zexpect, sizeof zexpect,
+                 "RECENT DEBUG (in test_elm.c:%d:test_crash_ring): quiet %%d\n",
+                 line);
+        CHK(nevals == 0);
+        CHK(strlen(out) > strlen(zexpect));
+        CHK(!strcmp(out + strlen(out) - strlen(zexpect), zexpect));
+
+        // only the most recent are kept
+        for(int k = 0; k < 100; k++)
+                LOG_F(null_log, "spam");
+        CHK(!pipe(pfd));
+        dump_crash_ring(pfd[1]);
+        close(pfd[1]);
+        out = read_fd(pfd[0]);
+        close(pfd[0]);
+        int nlines = 0;
+        for(char *z = out; (z = strstr(z, "): spam\n")); z++)
+                nlines++;
+        CHK(nlines == ELM_CRASH_RING);
+
+        // dumped when the process dies, by panic or by signal.
+        for(int by_signal = 0; by_signal < 2; by_signal++) {
+                CHK(!pipe(pfd));
+                fflush(stdout);
+                pid_t pid = fork();
+                CHK(pid >= 0);
+                if(!pid)
+                        _exit(die_with_ring(pfd, by_signal));
+                close(pfd[1]);
+                out = read_fd(pfd[0]);
+                close(pfd[0]);
+                CHK(waitpid(pid, &status, 0) == pid);
+                CHK(by_signal ? WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT
+                              : WIFEXITED(status) && WEXITSTATUS(status));
+                CHK(strstr(out, "RECENT WARN (in test_elm.c:"));
+                CHK(strstr(out, ":die_with_ring): last words %d\n"));
+        }
+
+        PASS();
+}
+
+TEST(test_panic_if)
 {
         PanicReturn ret;
         Error *err;
@@ -658,35 +1931,197 @@ static int test_panic_if()
         PASS();
 }
 
+// ----------------------------------------------------------------------------
 
-// -- Main -----------------------------
+#define STRESS_NTHREADS 8
+#define STRESS_NROUNDS  10000
 
-int main(int argc, const char **argv)
+static double elapsed_seconds(const struct timespec *t0)
+{
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        return (t1.tv_sec - t0->tv_sec) + 1e-9 * (t1.tv_nsec - t0->tv_nsec);
+}
+
+static void *stress_panic_thread(void *arg)
+/* Nested TRY/panic, rethrowing from the inner handler on odd rounds.  Returns
+   the number of rounds that did not unwind as expected. */
+{
+        intptr_t nbad = 0;
+        (void)arg;
+
+        for(int k = 0; k < STRESS_NROUNDS; k++) {
+                PanicReturn outer, inner;
+                Error *err;
+                volatile int caught_inner = 0;
+
+                if(err = TRY(outer)) {
+                        nbad += !(k & 1) || !caught_inner;
+                        nbad += strcmp(err->meta.func, __func__);
+                        destroy_error(err);
+                        nbad += panic_is_caught();
+                        continue;
+                }
+
+                if(err = TRY(inner)) {
+                        caught_inner = 1;
+                        if(k & 1)
+                                panic(err);
+                        destroy_error(err);
+                } else {
+                        PANIC("round %d", k);
+                        NO_WORRIES(inner);
+                }
+
+                nbad += (k & 1) || !caught_inner || !panic_is_caught();
+                NO_WORRIES(outer);
+                nbad += panic_is_caught();
+        }
+
+        return (void*)nbad;
+}
+
+TEST(test_threaded_panic)
 {
-        test_versions();
+        pthread_t threads[STRESS_NTHREADS];
+        struct timespec t0;
+        intptr_t nbad = 0;
+
+        CHK(!panic_is_caught());
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(int k = 0; k < STRESS_NTHREADS; k++)
+                CHK(!pthread_create(threads + k, NULL, stress_panic_thread, 0));
+
+        for(int k = 0; k < STRESS_NTHREADS; k++) {
+                void *r;
+                CHK(!pthread_join(threads[k], &r));
+                nbad += (intptr_t)r;
+        }
+        double dt = elapsed_seconds(&t0);
 
-        test_errors();
-        test_error_format();
-        test_keep_first_error();
-        test_simple_custom_error();
+        CHK(nbad == 0);
+        CHK(!panic_is_caught());
+        NOTE("%d threads, %.0f panics/s", STRESS_NTHREADS,
+             STRESS_NTHREADS * STRESS_NROUNDS / dt);
 
-        test_panic_if();
+        PASS();
+}
 
-        test_system_error();
-        test_variadic_system_error();
-        test_unpack_system_error();
+#define TRY_NROUNDS 1000000
 
-        test_bad_malloc();
-        test_rescued_malloc();
+static void panic_in_default_try()
+/* Panics from inside a TRY made with the default ELM_TRY_JMP, and rethrows. */
+{
+        PanicReturn ret;
+        Error *err;
+        if(err = TRY(ret))
+                panic(err);
+        PANIC("from %s", __func__);
+        NO_WORRIES(ret);
+}
+
+/* Defines try_cost_K(), which must be compiled with ELM_TRY_JMP=K.  It checks
+   that a panic is caught and that saving the registers leaves the rest of the
+   PanicReturn alone, and then returns the ns taken to enter and leave a TRY
+   (or -1 if a check failed). */
+#define TRY_COST(K)                                                     \
+static double try_cost_##K()                                            \
+{                                                                       \
+        PanicReturn outer, ret;                                         \
+        Error *err;                                                     \
+        struct timespec t0;                                             \
+        int ok = 0;                                                     \
+                                                                        \
+        if(!TRY(outer)) {                                               \
+                if(!TRY(ret)) {                                         \
+                        ok = ret.prev == &outer;                        \
+                        NO_WORRIES(ret);                                \
+                }                                                       \
+                NO_WORRIES(outer);                                      \
+        }                                                               \
+        if(!ok)                                                         \
+                return -1;                                              \
+        if(!(err = TRY(ret))) {                                         \
+                panic_in_default_try();                                 \
+                NO_WORRIES(ret);                                        \
+                return -1;                                              \
+        }                                                               \
+        ok = err->type == error_type && !panic_is_caught();             \
+        destroy_error(err);                                             \
+        if(!ok)                                                         \
+                return -1;                                              \
+                                                                        \
+        clock_gettime(CLOCK_MONOTONIC, &t0);                            \
+        for(int k = 0; k < TRY_NROUNDS; k++)                            \
+                if(!TRY(ret))                                           \
+                        NO_WORRIES(ret);                                \
+        return 1e9 * elapsed_seconds(&t0) / TRY_NROUNDS;                \
+}
 
-        test_logging();
-        test_debug_logger();
+#undef ELM_TRY_JMP
+#define ELM_TRY_JMP setjmp
+TRY_COST(setjmp)
+#undef ELM_TRY_JMP
+#define ELM_TRY_JMP sigsetjmp
+TRY_COST(sigsetjmp)
+#undef ELM_TRY_JMP
+#define ELM_TRY_JMP builtin
+TRY_COST(builtin)
+#undef ELM_TRY_JMP
+#define ELM_TRY_JMP setjmp
+
+TEST(test_try_variants)
+{
+        double ns_setjmp = try_cost_setjmp(),
+               ns_sigsetjmp = try_cost_sigsetjmp(),
+               ns_builtin = try_cost_builtin();
+
+        CHK(ns_setjmp >= 0 && ns_sigsetjmp >= 0 && ns_builtin >= 0);
+        CHK(!panic_is_caught());
+        NOTE("TRY + NO_WORRIES: setjmp %.1f ns, sigsetjmp %.1f ns, "
+             "builtin %.1f ns",
+             ns_setjmp, ns_sigsetjmp, ns_builtin);
+        PASS();
+}
+
+static Error *heap_error(const char *zfmt, ...)
+/* What ERROR used to do: malloc() the error and vasprintf() the message. */
+{
+        va_list va;
+        Error *e = malloc(sizeof(Error));
+        *e = (Error){ .type = error_type };
+
+        va_start(va, zfmt);
+        if(vasprintf((char**)&e->data, zfmt, va) < 0)
+                e->data = NULL;
+        va_end(va);
+        return e;
+}
+
+TEST(test_error_speed)
+{
+        Error *e;
+        int k = 0;
+
+        BENCH("malloc + vasprintf",
+              e = heap_error("bad token %d at %s", k++, "here");
+              free(e->data);
+              free(e));
+        BENCH("ERROR + destroy_error",
+              destroy_error(ERROR("bad token %d at %s", k++, "here")));
+        BENCH("LAZY_ERROR + destroy_error",
+              destroy_error(LAZY_ERROR("bad token %d at %s", k++, "here")));
+        PASS();
+}
+
+
+// -- Main -----------------------------
+
+int main(int argc, const char **argv)
+{
         LOG_F(null_log, "EEEK!  I'm invisible!  Don't look!");
-        test_logger_refcounts();
-        test_static_logger_refcounts();
+        zunit_main(argc, argv);
 
-        test_try_panic();
-        test_recursive_panic();
         if( argc > 1 && !strcmp(argv[1], "--panic") )
                 PANIC("The slithy toves!"); //FIX
         if( argc > 1 && !strncmp(argv[1], "--panic=", 8) ) {
@@ -698,10 +2133,12 @@ int main(int argc, const char **argv)
 
                 PANIC("The slithy toves!"); //FIX
         }
-        if(FAKE_FAIL)
-                runtests_malloc_fail();
-        else
-                test_malloc(128 * 1024);
+        if(zunit_selected("test_malloc")) {
+                if(FAKE_FAIL)
+                        runtests_malloc_fail();
+                else
+                        test_malloc(128 * 1024);
+        }
 
         return zunit_report();
 }